@@ -5,8 +5,23 @@
 
 #include <functional>
 #include <set>
+#include <vector>
+#include <algorithm>
 #include <cassert>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <iterator>
+#include <new>
+#include <utility>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 class InvalidArg : public std::exception {
 public:
@@ -16,356 +31,4937 @@ public:
     }
 };
 
-template<typename A, typename V>
+namespace function_maxima_detail{
+
+    template<typename T>
+    constexpr bool is_small_trivial = std::is_trivially_copy_constructible<T>::value &&
+                                      std::is_trivially_copy_assignable<T>::value &&
+                                      std::is_trivially_destructible<T>::value;
+
+    // Points are stored inline when copying them is as cheap as copying a handle.
+    template<typename A, typename V>
+    constexpr bool stores_inline = is_small_trivial<A> && is_small_trivial<V> &&
+                                   sizeof(A) + sizeof(V) <= 2 * sizeof(void*);
+
+    // Orders points by their arguments.
+    template<typename A, typename Point>
+    struct compare_points{
+
+        using is_transparent = void;
+        bool operator()(const Point& lhs, const Point& rhs) const {
+            return lhs.arg() < rhs.arg();
+        }
+
+        bool operator()(const A& lhs, const Point& rhs) const {
+            return lhs < rhs.arg();
+        }
+        bool operator()(const Point& lhs, const A& rhs) const {
+            return lhs.arg() < rhs;
+        }
+    };
+
+    // Orders points by decreasing values, points with equal values by their arguments.
+    template<typename Point>
+    struct compare_maxima{
+        using is_transparent = void;
+        bool operator()(const Point& lhs, const Point& rhs) const{
+            if (rhs.value() < lhs.value()) return true;
+            else if (lhs.value() < rhs.value()) return false;
+            return lhs.arg() < rhs.arg();
+        }
+    };
+
+    // Orders points by their arguments, points with equal arguments by decreasing
+    // values. Keys of the maxima are unique in this order even while an overwritten
+    // point and the one replacing it are both maxima. Lookups by A are transparent.
+    template<typename A, typename Point>
+    struct compare_maxima_by_argument{
+        using is_transparent = void;
+        bool operator()(const Point& lhs, const Point& rhs) const{
+            if (lhs.arg() < rhs.arg()) return true;
+            else if (rhs.arg() < lhs.arg()) return false;
+            return rhs.value() < lhs.value();
+        }
+
+        bool operator()(const A& lhs, const Point& rhs) const {
+            return lhs < rhs.arg();
+        }
+        bool operator()(const Point& lhs, const A& rhs) const {
+            return lhs.arg() < rhs;
+        }
+    };
+
+    // Orders points by increasing values, points with equal values by their arguments.
+    template<typename Point>
+    struct compare_minima{
+        bool operator()(const Point& lhs, const Point& rhs) const{
+            if (lhs.value() < rhs.value()) return true;
+            else if (rhs.value() < lhs.value()) return false;
+            return lhs.arg() < rhs.arg();
+        }
+    };
+
+    // A point is a local maximum when none of its neighbours (nullptr if there is
+    // no neighbour on that side) has a greater value. This function has Strong Guarantee.
+    template<typename V>
+    bool is_local_maximum(const V* left, const V& value, const V* right){
+        if(left != nullptr && value < *left) return false;
+        if(right != nullptr && value < *right) return false;
+        return true;
+    }
+
+    // A point is a local minimum when none of its neighbours has a lesser value.
+    // This function has Strong Guarantee.
+    template<typename V>
+    bool is_local_minimum(const V* left, const V& value, const V* right){
+        if(left != nullptr && *left < value) return false;
+        if(right != nullptr && *right < value) return false;
+        return true;
+    }
+
+    // Fills an empty container of points with a range of (argument, value) pairs
+    // sorted by arguments, using make_point to create the points. Of several pairs
+    // with equal arguments the last one is kept. Throws InvalidArg if the range is
+    // not sorted. Takes amortised constant time per pair.
+    template<typename Container, typename Iterator, typename MakePoint>
+    void append_sorted(Container& points, Iterator first, Iterator last, MakePoint make_point){
+        for(; first != last; ++first) {
+            if(!points.empty()) {
+                const auto& back = *std::prev(points.end());
+                if((*first).first < back.arg()) {
+                    throw InvalidArg();
+                }
+                if(!(back.arg() < (*first).first)) {
+                    points.erase(std::prev(points.end()));
+                }
+            }
+            points.insert(points.end(), make_point((*first).first, (*first).second));
+        }
+    }
+
+    // Creates the points given by a range of (argument, value) pairs and sorts them
+    // by arguments. Of several pairs with equal arguments only the last one is kept.
+    template<typename Point, typename Iterator, typename MakePoint>
+    std::vector<Point> sorted_updates(Iterator first, Iterator last, MakePoint make_point){
+        std::vector<Point> updates;
+        using category = typename std::iterator_traits<Iterator>::iterator_category;
+        if constexpr (std::is_base_of<std::forward_iterator_tag, category>::value) {
+            updates.reserve(std::distance(first, last));
+        }
+        for(; first != last; ++first) {
+            updates.push_back(make_point((*first).first, (*first).second));
+        }
+        auto by_argument = [](const Point& lhs, const Point& rhs){
+            return lhs.arg() < rhs.arg();
+        };
+        // Batches are often sorted already, which is checked without allocating.
+        if(!std::is_sorted(updates.begin(), updates.end(), by_argument)) {
+            std::stable_sort(updates.begin(), updates.end(), by_argument);
+        }
+        std::size_t kept = 0;
+        for(std::size_t i = 0; i < updates.size(); i++) {
+            if(i + 1 == updates.size() || updates[i].arg() < updates[i + 1].arg()) {
+                updates[kept++] = std::move(updates[i]);
+            }
+        }
+        updates.erase(updates.begin() + kept, updates.end());
+        return updates;
+    }
+
+    // Makes room for extra more elements in a vector, growing it geometrically, so
+    // that reserving before every insertion keeps the insertions amortised.
+    template<typename Vector>
+    void reserve_more(Vector& v, std::size_t extra){
+        if(v.capacity() - v.size() >= extra) return;
+        v.reserve(std::max(2 * v.capacity(), v.size() + extra));
+    }
+
+    // Insertion sort for the few elements changed by a single operation.
+    template<typename T, typename Compare>
+    void sort_small(T* first, T* last, Compare compare){
+        for(T* i = first; i != last; ++i) {
+            for(T* j = i; j != first && compare(*j, *(j - 1)); --j) {
+                std::swap(*j, *(j - 1));
+            }
+        }
+    }
+
+    // Tells whether the iterators of a container stay valid when other elements
+    // are inserted or erased.
+    template<typename Container>
+    struct has_stable_iterators : std::false_type {};
+
+    template<typename T, typename Compare, typename Allocator>
+    struct has_stable_iterators<std::multiset<T, Compare, Allocator>> : std::true_type {};
+
+    // Replaces the element at pos with value, which must be equivalent to it, in the
+    // node that holds it, so that every iterator to it stays valid. No-throw.
+    template<typename Container>
+    struct element_replacer{
+        static void replace(Container& container, typename Container::const_iterator pos,
+                            const typename Container::value_type& value) noexcept{
+            container.replace(pos, value);
+        }
+    };
+
+    // Elements of a std::multiset are const, so only the mutable members of the point
+    // are replaced, see FunctionPoint::replace. The order of the set is kept, as the
+    // arguments are equivalent.
+    template<typename T, typename Compare, typename Allocator>
+    struct element_replacer<std::multiset<T, Compare, Allocator>>{
+        static void replace(std::multiset<T, Compare, Allocator>&,
+                            typename std::multiset<T, Compare, Allocator>::const_iterator pos,
+                            const T& value) noexcept{
+            pos->replace(value);
+        }
+    };
+
+    // A range of local maxima, returned by top_k and maxima_in. Like the iterators it
+    // holds, it is invalidated by the operations modifying the function.
+    template<typename Iterator>
+    class maxima_view{
+    public:
+        maxima_view(Iterator first, Iterator last, std::size_t count) noexcept:
+        first(first), last(last), count(count)
+        {}
+
+        Iterator begin() const noexcept{
+            return first;
+        }
+
+        Iterator end() const noexcept{
+            return last;
+        }
+
+        std::size_t size() const noexcept{
+            return count;
+        }
+
+        bool empty() const noexcept{
+            return count == 0;
+        }
+
+    private:
+        Iterator first;
+        Iterator last;
+        std::size_t count;
+    };
+
+    // The first min(k, size) elements of [first, last), in O(k) time, or O(1) for
+    // random access iterators.
+    template<typename Iterator>
+    maxima_view<Iterator> first_k(Iterator first, Iterator last, std::size_t k) noexcept{
+        using category = typename std::iterator_traits<Iterator>::iterator_category;
+        if constexpr (std::is_base_of<std::random_access_iterator_tag, category>::value) {
+            std::size_t count = std::min(k, static_cast<std::size_t>(last - first));
+            return maxima_view<Iterator>(first, first + count, count);
+        }
+        else {
+            Iterator it = first;
+            std::size_t count = 0;
+            for(; count < k && it != last; ++it) {
+                count++;
+            }
+            return maxima_view<Iterator>(first, it, count);
+        }
+    }
+
+    // Local maxima in the order of compare_maxima, also kept in a second set ordered
+    // by arguments for the range queries. Provides the part of the interface of
+    // std::set used by FunctionMaxima, except that find and insert return positions
+    // in both sets, so that erasing never compares anything.
+    template<typename A, typename Point, typename CompareMaxima, typename Allocator = std::allocator<Point>>
+    class indexed_maxima{
+        using value_set = std::set<Point, CompareMaxima, Allocator>;
+        using argument_set = std::set<Point, compare_maxima_by_argument<A, Point>, Allocator>;
+
+    public:
+        using const_iterator = typename value_set::const_iterator;
+        using argument_iterator = typename argument_set::const_iterator;
+
+        // Position of a maximum in both sets. Compares equal to end() if there is none.
+        struct iterator{
+            const_iterator by_value;
+            argument_iterator by_argument;
+
+            const Point& operator*() const noexcept{
+                return *by_value;
+            }
+
+            friend bool operator==(const iterator& lhs, const const_iterator& rhs) noexcept{
+                return lhs.by_value == rhs;
+            }
+
+            friend bool operator!=(const iterator& lhs, const const_iterator& rhs) noexcept{
+                return lhs.by_value != rhs;
+            }
+        };
+
+        const_iterator begin() const noexcept{
+            return values.begin();
+        }
+
+        const_iterator end() const noexcept{
+            return values.end();
+        }
+
+        bool empty() const noexcept{
+            return values.empty();
+        }
+
+        std::size_t size() const noexcept{
+            return values.size();
+        }
+
+        iterator find(const Point& p) const{
+            const_iterator by_value = values.find(p);
+            if(by_value == values.end()) return iterator{by_value, arguments.end()};
+            return iterator{by_value, arguments.find(p)};
+        }
+
+        // Strong Guarantee.
+        std::pair<iterator, bool> insert(const Point& p){
+            return add_argument(values.insert(p), p);
+        }
+
+        iterator insert(const_iterator hint, const Point& p){
+            std::size_t before = values.size();
+            const_iterator by_value = values.insert(hint, p);
+            return add_argument(std::make_pair(by_value, values.size() != before), p).first;
+        }
+
+        // No-throw.
+        void erase(const iterator& position) noexcept{
+            values.erase(position.by_value);
+            arguments.erase(position.by_argument);
+        }
+
+        void swap(indexed_maxima& rhs) noexcept{
+            values.swap(rhs.values);
+            arguments.swap(rhs.arguments);
+        }
+
+        // Maxima with arguments in [lo, hi], in the order of arguments.
+        maxima_view<argument_iterator> in_range(const A& lo, const A& hi) const{
+            if(hi < lo) return maxima_view<argument_iterator>(arguments.end(), arguments.end(), 0);
+            argument_iterator first = arguments.lower_bound(lo);
+            argument_iterator last = arguments.upper_bound(hi);
+            return maxima_view<argument_iterator>(first, last, std::distance(first, last));
+        }
+
+    private:
+        // Completes the insertion of p into values, which has given result.
+        std::pair<iterator, bool> add_argument(std::pair<const_iterator, bool> result, const Point& p){
+            if(!result.second) return std::make_pair(iterator{result.first, arguments.find(p)}, false);
+            try {
+                return std::make_pair(iterator{result.first, arguments.insert(p).first}, true);
+            }
+            catch(...) {
+                values.erase(result.first);
+                throw;
+            }
+        }
+
+        value_set values;
+        argument_set arguments;
+    };
+
+    // Points ordered by their arguments in a treap whose nodes know the greatest value
+    // in their subtrees, answering range maximum queries in O(log n) expected time.
+    //
+    // Modifications are staged: the old links of every node modified in place are
+    // logged first, so rollback can restore the committed tree, and removed nodes are
+    // only freed by commit. Comparisons may throw anywhere before commit, commit and
+    // rollback are no-throw.
+    // Nodes are allocated by a default-constructed Allocator rebound to their type.
+    template<typename A, typename Point, typename Allocator = std::allocator<Point>>
+    class range_max_index{
+
+        struct node{
+            Point point;
+            node* left;
+            node* right;
+            // Point with the greatest value in the subtree, the least argument on ties.
+            const Point* best;
+            std::uint32_t priority;
+
+            node(const Point& p, std::uint32_t priority) noexcept:
+            point(p), left(nullptr), right(nullptr), best(&point), priority(priority)
+            {}
+        };
+
+        // Links of a node before it was modified.
+        struct saved_links{
+            node* target;
+            node* left;
+            node* right;
+            const Point* best;
+        };
+
+        node* root = nullptr;
+        node* committed = nullptr;
+        std::vector<saved_links> undo;
+        std::vector<std::pair<node*, Point>> replaced;
+        std::vector<node*> created;
+        std::vector<node*> dropped;
+        std::uint32_t seed = 2463534242u;
+
+        std::uint32_t next_priority() noexcept{
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            return seed;
+        }
+
+        using node_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<node>;
+
+        static node* new_node(const Point& p, std::uint32_t priority){
+            node_allocator alloc;
+            node* t = std::allocator_traits<node_allocator>::allocate(alloc, 1);
+            return ::new (static_cast<void*>(t)) node(p, priority);
+        }
+
+        // No-throw, does nothing for nullptr.
+        static void free_node(node* t) noexcept{
+            if(t == nullptr) return;
+            node_allocator alloc;
+            t->~node();
+            std::allocator_traits<node_allocator>::deallocate(alloc, t, 1);
+        }
+
+        static void destroy(node* t) noexcept{
+            if(t == nullptr) return;
+            destroy(t->left);
+            destroy(t->right);
+            free_node(t);
+        }
+
+        // Copies a whole tree. The best points are found again by their positions,
+        // without comparing anything.
+        static node* clone(const node* t){
+            if(t == nullptr) return nullptr;
+            node* copy = new_node(t->point, t->priority);
+            try {
+                copy->left = clone(t->left);
+                copy->right = clone(t->right);
+            }
+            catch(...) {
+                destroy(copy);
+                throw;
+            }
+            if(t->left != nullptr && t->best == t->left->best) copy->best = copy->left->best;
+            else if(t->right != nullptr && t->best == t->right->best) copy->best = copy->right->best;
+            return copy;
+        }
+
+        node* make_node(const Point& p){
+            created.push_back(nullptr);
+            created.back() = new_node(p, next_priority());
+            return created.back();
+        }
+
+        // Logs the links of t before they are modified.
+        void touch(node* t){
+            undo.push_back(saved_links{t, t->left, t->right, t->best});
+        }
+
+        // Recomputes the best point of t from its children. Ties go to the left, as
+        // the arguments grow from left to right.
+        static void pull(node* t){
+            const Point* best = t->left != nullptr ? t->left->best : nullptr;
+            if(best == nullptr || best->value() < t->point.value()) best = &t->point;
+            if(t->right != nullptr && best->value() < t->right->best->value()) best = t->right->best;
+            t->best = best;
+        }
+
+        // Splits t into the points with arguments less than a (not greater than a if
+        // inclusive) and the rest.
+        void split(node* t, const A& a, bool inclusive, node*& left, node*& right){
+            if(t == nullptr) {
+                left = right = nullptr;
+                return;
+            }
+            bool goes_left = inclusive ? !(a < t->point.arg()) : t->point.arg() < a;
+            touch(t);
+            if(goes_left) {
+                split(t->right, a, inclusive, t->right, right);
+                left = t;
+            }
+            else {
+                split(t->left, a, inclusive, left, t->left);
+                right = t;
+            }
+            pull(t);
+        }
+
+        // Joins two trees, all the arguments in left being less than those in right.
+        node* merge(node* left, node* right){
+            if(left == nullptr) return right;
+            if(right == nullptr) return left;
+            if(right->priority < left->priority) {
+                touch(left);
+                left->right = merge(left->right, right);
+                pull(left);
+                return left;
+            }
+            touch(right);
+            right->left = merge(left, right->left);
+            pull(right);
+            return right;
+        }
+
+        // Puts n, whose argument is not in t yet, into t. Returns the new root of t.
+        node* insert(node* t, node* n){
+            if(t == nullptr) return n;
+            const A& a = n->point.arg();
+            if(t->priority < n->priority) {
+                split(t, a, false, n->left, n->right);
+                pull(n);
+                return n;
+            }
+            touch(t);
+            if(a < t->point.arg()) t->left = insert(t->left, n);
+            else t->right = insert(t->right, n);
+            pull(t);
+            return t;
+        }
+
+        // Replaces the point with the argument of p, which is in t, by p.
+        void replace(node* t, const Point& p){
+            touch(t);
+            if(p.arg() < t->point.arg()) replace(t->left, p);
+            else if(t->point.arg() < p.arg()) replace(t->right, p);
+            else {
+                replaced.push_back(std::make_pair(t, t->point));
+                t->point = p;
+            }
+            pull(t);
+        }
+
+        // Checks if the subtree t holds a point for a.
+        static bool found(const node* t, const A& a){
+            while(t != nullptr) {
+                if(a < t->point.arg()) t = t->left;
+                else if(t->point.arg() < a) t = t->right;
+                else return true;
+            }
+            return false;
+        }
+
+        // Removes the points with arguments in [lo, hi) (or [lo, hi] if inclusive).
+        void cut(const A& lo, const A& hi, bool inclusive){
+            node* left;
+            node* middle;
+            node* right;
+            split(root, lo, false, left, right);
+            split(right, hi, inclusive, middle, right);
+            dropped.push_back(nullptr);
+            root = merge(left, right);
+            dropped.back() = middle;
+        }
+
+        // Better of two points: the greater value, the lesser argument on ties.
+        static const Point* better(const Point* lhs, const Point* rhs){
+            if(lhs == nullptr) return rhs;
+            if(rhs == nullptr) return lhs;
+            if(lhs->value() < rhs->value()) return rhs;
+            if(rhs->value() < lhs->value()) return lhs;
+            return rhs->arg() < lhs->arg() ? rhs : lhs;
+        }
+
+        static void update_all(node* t){
+            if(t == nullptr) return;
+            update_all(t->left);
+            update_all(t->right);
+            pull(t);
+        }
+
+    public:
+
+        range_max_index() = default;
+
+        range_max_index(const range_max_index& rhs): root(clone(rhs.committed)), committed(root)
+        {}
+
+        ~range_max_index(){
+            rollback();
+            destroy(root);
+        }
+
+        range_max_index& operator=(range_max_index rhs) noexcept{
+            swap(rhs);
+            return *this;
+        }
+
+        void swap(range_max_index& rhs) noexcept{
+            std::swap(root, rhs.root);
+            std::swap(committed, rhs.committed);
+            undo.swap(rhs.undo);
+            replaced.swap(rhs.replaced);
+            created.swap(rhs.created);
+            dropped.swap(rhs.dropped);
+            std::swap(seed, rhs.seed);
+        }
+
+        // Stages setting the point for the argument of p.
+        void set(const Point& p){
+            if(found(root, p.arg())) replace(root, p);
+            else root = insert(root, make_node(p));
+        }
+
+        // Stages erasing the point for a.
+        void erase(const A& a){
+            cut(a, a, true);
+        }
+
+        // Stages erasing the points with arguments in [lo, hi).
+        void erase_range(const A& lo, const A& hi){
+            cut(lo, hi, false);
+        }
+
+        // Makes the staged modifications permanent. No-throw.
+        void commit() noexcept{
+            for(node* t : dropped) {
+                destroy(t);
+            }
+            undo.clear();
+            replaced.clear();
+            created.clear();
+            dropped.clear();
+            committed = root;
+        }
+
+        // Discards the staged modifications. No-throw.
+        void rollback() noexcept{
+            for(auto it = undo.rbegin(); it != undo.rend(); ++it) {
+                it->target->left = it->left;
+                it->target->right = it->right;
+                it->target->best = it->best;
+            }
+            for(auto it = replaced.rbegin(); it != replaced.rend(); ++it) {
+                it->first->point = it->second;
+            }
+            for(node* t : created) {
+                free_node(t);
+            }
+            undo.clear();
+            replaced.clear();
+            created.clear();
+            dropped.clear();
+            root = committed;
+        }
+
+        // Replaces the contents with the points from [first, last), sorted by their
+        // arguments, in O(n) time. Staged as the other modifications.
+        template<typename Iterator>
+        void assign_sorted(Iterator first, Iterator last){
+            dropped.push_back(root);
+            root = nullptr;
+            std::vector<node*> spine;
+            for(; first != last; ++first) {
+                node* t = make_node(*first);
+                node* below = nullptr;
+                while(!spine.empty() && spine.back()->priority < t->priority) {
+                    below = spine.back();
+                    spine.pop_back();
+                }
+                t->left = below;
+                if(!spine.empty()) spine.back()->right = t;
+                spine.push_back(t);
+            }
+            if(!spine.empty()) {
+                root = spine.front();
+                update_all(root);
+            }
+        }
+
+        // Point with the greatest value among the ones with arguments in [lo, hi],
+        // the least argument on ties, or nullptr if there is none.
+        const Point* max_in(const A& lo, const A& hi) const{
+            node* t = root;
+            while(t != nullptr && (t->point.arg() < lo || hi < t->point.arg())) {
+                t = t->point.arg() < lo ? t->right : t->left;
+            }
+            if(t == nullptr) return nullptr;
+
+            const Point* best = &t->point;
+            for(node* x = t->left; x != nullptr;) {
+                if(x->point.arg() < lo) {
+                    x = x->right;
+                    continue;
+                }
+                best = better(&x->point, best);
+                if(x->right != nullptr) best = better(x->right->best, best);
+                x = x->left;
+            }
+            for(node* x = t->right; x != nullptr;) {
+                if(hi < x->point.arg()) {
+                    x = x->left;
+                    continue;
+                }
+                best = better(&x->point, best);
+                if(x->left != nullptr) best = better(x->left->best, best);
+                x = x->right;
+            }
+            return best;
+        }
+    };
+
+    // Stands in for range_max_index when the policy does not ask for it.
+    template<typename A, typename Point>
+    struct no_range_index{
+        void swap(no_range_index&) noexcept {}
+        void set(const Point&) noexcept {}
+        void erase(const A&) noexcept {}
+        void erase_range(const A&, const A&) noexcept {}
+        void commit() noexcept {}
+        void rollback() noexcept {}
+        template<typename Iterator>
+        void assign_sorted(Iterator, Iterator) noexcept {}
+    };
+
+    // Set of bits numbered from 0 to size() - 1, looking for the nearest set bits
+    // a whole word at a time.
+    class bitmap{
+
+        static const std::size_t WORD_BITS = 64;
+
+        std::vector<std::uint64_t> words;
+        std::size_t bits;
+
+        static std::size_t lowest_bit(std::uint64_t word) noexcept{
+#if defined(__GNUC__)
+            return __builtin_ctzll(word);
+#else
+            std::size_t i = 0;
+            while(!(word >> i & 1)) i++;
+            return i;
+#endif
+        }
+
+        static std::size_t highest_bit(std::uint64_t word) noexcept{
+#if defined(__GNUC__)
+            return WORD_BITS - 1 - __builtin_clzll(word);
+#else
+            std::size_t i = WORD_BITS - 1;
+            while(!(word >> i & 1)) i--;
+            return i;
+#endif
+        }
+
+    public:
+
+        explicit bitmap(std::size_t size = 0): words((size + WORD_BITS - 1) / WORD_BITS), bits(size) {}
+
+        std::size_t size() const noexcept{
+            return bits;
+        }
+
+        // The words of the bitmap, bit i of the whole is bit i % 64 of word i / 64.
+        std::uint64_t* data() noexcept{
+            return words.data();
+        }
+
+        bool test(std::size_t i) const noexcept{
+            return words[i / WORD_BITS] >> (i % WORD_BITS) & 1;
+        }
+
+        void flip(std::size_t i) noexcept{
+            words[i / WORD_BITS] ^= std::uint64_t(1) << (i % WORD_BITS);
+        }
+
+        // Index of the first set bit not smaller than from, or size() if there is none.
+        std::size_t next(std::size_t from) const noexcept{
+            if(from >= bits) return bits;
+            std::size_t w = from / WORD_BITS;
+            std::uint64_t word = words[w] & (~std::uint64_t(0) << (from % WORD_BITS));
+            while(word == 0) {
+                if(++w == words.size()) return bits;
+                word = words[w];
+            }
+            return w * WORD_BITS + lowest_bit(word);
+        }
+
+        // Index of the last set bit smaller than before, or size() if there is none.
+        std::size_t prev(std::size_t before) const noexcept{
+            if(before == 0) return bits;
+            std::size_t w = (before - 1) / WORD_BITS;
+            std::uint64_t word = words[w] & (~std::uint64_t(0) >> (WORD_BITS - 1 - (before - 1) % WORD_BITS));
+            while(word == 0) {
+                if(w == 0) return bits;
+                word = words[--w];
+            }
+            return w * WORD_BITS + highest_bit(word);
+        }
+    };
+
+    template<bool Minimum, typename V>
+    bool is_local_extremum(const V* left, const V& value, const V* right){
+        return Minimum ? is_local_minimum(left, value, right) : is_local_maximum(left, value, right);
+    }
+
+    // Values whose local extrema are found with vector instructions, see extrema_mask.
+    template<typename V>
+    constexpr bool has_extrema_kernel =
+        (std::is_integral<V>::value && std::is_signed<V>::value && (sizeof(V) == 4 || sizeof(V) == 8)) ||
+        std::is_same<V, float>::value || std::is_same<V, double>::value;
+
+    template<bool Minimum, typename V>
+    void extrema_mask_scalar(const V* values, std::size_t n, std::size_t from, std::size_t to,
+                             std::uint64_t* mask) noexcept{
+        for(std::size_t i = from; i < to; i++) {
+            const V* left = i == 0 ? nullptr : values + i - 1;
+            const V* right = i + 1 == n ? nullptr : values + i + 1;
+            if(is_local_extremum<Minimum>(left, values[i], right)) {
+                mask[i / 64] |= std::uint64_t(1) << (i % 64);
+            }
+        }
+    }
+
+#if defined(__GNUC__) && defined(__x86_64__)
+    // Bit j tells whether the value v[j], for j from [0, 32 / sizeof(V)), is a local
+    // maximum (or minimum) given v[j - 1] and v[j + 1]. Comparisons are the ones of
+    // operator<, so a NaN is an extremum like in is_local_maximum.
+    template<bool Minimum, typename V>
+    __attribute__((target("avx2")))
+    unsigned extrema_lanes_avx2(const V* v) noexcept{
+        if constexpr (std::is_same<V, float>::value) {
+            __m256 c = _mm256_loadu_ps(v);
+            __m256 l = _mm256_loadu_ps(v - 1);
+            __m256 r = _mm256_loadu_ps(v + 1);
+            __m256 bad = Minimum ? _mm256_or_ps(_mm256_cmp_ps(l, c, _CMP_LT_OQ), _mm256_cmp_ps(r, c, _CMP_LT_OQ))
+                                 : _mm256_or_ps(_mm256_cmp_ps(c, l, _CMP_LT_OQ), _mm256_cmp_ps(c, r, _CMP_LT_OQ));
+            return ~_mm256_movemask_ps(bad) & 0xFF;
+        }
+        else if constexpr (std::is_same<V, double>::value) {
+            __m256d c = _mm256_loadu_pd(v);
+            __m256d l = _mm256_loadu_pd(v - 1);
+            __m256d r = _mm256_loadu_pd(v + 1);
+            __m256d bad = Minimum ? _mm256_or_pd(_mm256_cmp_pd(l, c, _CMP_LT_OQ), _mm256_cmp_pd(r, c, _CMP_LT_OQ))
+                                  : _mm256_or_pd(_mm256_cmp_pd(c, l, _CMP_LT_OQ), _mm256_cmp_pd(c, r, _CMP_LT_OQ));
+            return ~_mm256_movemask_pd(bad) & 0xF;
+        }
+        else if constexpr (sizeof(V) == 4) {
+            __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v));
+            __m256i l = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v - 1));
+            __m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v + 1));
+            // a < b is b > a.
+            __m256i bad = Minimum ? _mm256_or_si256(_mm256_cmpgt_epi32(c, l), _mm256_cmpgt_epi32(c, r))
+                                  : _mm256_or_si256(_mm256_cmpgt_epi32(l, c), _mm256_cmpgt_epi32(r, c));
+            return ~_mm256_movemask_ps(_mm256_castsi256_ps(bad)) & 0xFF;
+        }
+        else {
+            __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v));
+            __m256i l = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v - 1));
+            __m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v + 1));
+            __m256i bad = Minimum ? _mm256_or_si256(_mm256_cmpgt_epi64(c, l), _mm256_cmpgt_epi64(c, r))
+                                  : _mm256_or_si256(_mm256_cmpgt_epi64(l, c), _mm256_cmpgt_epi64(r, c));
+            return ~_mm256_movemask_pd(_mm256_castsi256_pd(bad)) & 0xF;
+        }
+    }
+
+    // The interior values go through extrema_lanes_avx2, the two ends and the tail
+    // shorter than a vector through the scalar loop.
+    template<bool Minimum, typename V>
+    __attribute__((target("avx2")))
+    void extrema_mask_avx2(const V* values, std::size_t n, std::uint64_t* mask) noexcept{
+        constexpr std::size_t lanes = 32 / sizeof(V);
+        std::size_t i = 1;
+        for(; i + lanes < n; i += lanes) {
+            std::uint64_t bits = extrema_lanes_avx2<Minimum>(values + i);
+            std::size_t shift = i % 64;
+            mask[i / 64] |= bits << shift;
+            if(shift + lanes > 64) mask[i / 64 + 1] |= bits >> (64 - shift);
+        }
+        extrema_mask_scalar<Minimum>(values, n, 0, std::min<std::size_t>(1, n), mask);
+        extrema_mask_scalar<Minimum>(values, n, i, n, mask);
+    }
+
+    inline bool has_avx2() noexcept{
+        static const bool result = []{
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") != 0;
+        }();
+        return result;
+    }
+#endif
+
+    // Sets bit i of mask, which must be cleared and have room for n bits, for every
+    // local maximum (or minimum) among n values. Uses AVX2 if the processor has it,
+    // the scalar loop otherwise.
+    template<bool Minimum, typename V>
+    void extrema_mask(const V* values, std::size_t n, std::uint64_t* mask) noexcept{
+#if defined(__GNUC__) && defined(__x86_64__)
+        if constexpr (has_extrema_kernel<V>) {
+            if(has_avx2()) {
+                extrema_mask_avx2<Minimum>(values, n, mask);
+                return;
+            }
+        }
+#endif
+        extrema_mask_scalar<Minimum>(values, n, 0, n, mask);
+    }
+
+    // Appends to result the local maxima (or minima) among the points at positions
+    // [lo, hi) of an array of n points, in the order of arguments. Arithmetic values
+    // with a kernel are first gathered in an array, together with the neighbours of
+    // the range, and go through extrema_mask.
+    template<bool Minimum, typename Point, typename Iterator>
+    void append_extrema(Iterator points, std::size_t n, std::size_t lo, std::size_t hi,
+                        std::vector<Point>& result){
+        using V = typename std::decay<decltype(points[0].value())>::type;
+        if constexpr (has_extrema_kernel<V>) {
+            std::size_t from = lo == 0 ? 0 : lo - 1;
+            std::size_t to = hi == n ? n : hi + 1;
+            std::vector<V> values(to - from);
+            for(std::size_t i = from; i < to; i++) {
+                values[i - from] = points[i].value();
+            }
+            bitmap mask(to - from);
+            extrema_mask<Minimum>(values.data(), values.size(), mask.data());
+            for(std::size_t i = mask.next(lo - from); i < hi - from; i = mask.next(i + 1)) {
+                result.push_back(points[from + i]);
+            }
+        }
+        else {
+            for(std::size_t i = lo; i < hi; i++) {
+                const V* left = i == 0 ? nullptr : &points[i - 1].value();
+                const V* right = i + 1 == n ? nullptr : &points[i + 1].value();
+                if(is_local_extremum<Minimum>(left, points[i].value(), right)) result.push_back(points[i]);
+            }
+        }
+    }
+
+    template<typename Point, bool Minimum>
+    using compare_extrema = typename std::conditional<Minimum, compare_minima<Point>, compare_maxima<Point>>::type;
+
+    // Returns the local maxima (or minima) among the points from [first, last), sorted
+    // by their arguments, in the order given by compare_maxima (or compare_minima).
+    // Apart from the sorting it takes a single linear sweep.
+    template<typename Point, bool Minimum, typename Iterator>
+    std::vector<Point> sorted_extrema(Iterator first, Iterator last){
+        std::vector<Point> result;
+        using category = typename std::iterator_traits<Iterator>::iterator_category;
+        if constexpr (std::is_base_of<std::random_access_iterator_tag, category>::value) {
+            std::size_t n = last - first;
+            append_extrema<Minimum>(first, n, 0, n, result);
+        }
+        else {
+            const Point* previous = nullptr;
+            for(Iterator it = first; it != last; ++it) {
+                Iterator next = std::next(it);
+                const auto* left = previous == nullptr ? nullptr : &previous->value();
+                const auto* right = next == last ? nullptr : &next->value();
+                if(is_local_extremum<Minimum>(left, it->value(), right)) result.push_back(*it);
+                previous = &*it;
+            }
+        }
+        std::sort(result.begin(), result.end(), compare_extrema<Point, Minimum>());
+        return result;
+    }
+
+    // Returns the local maxima among the points from [first, last), sorted by their
+    // arguments, in the order given by compare_maxima.
+    template<typename Point, typename Iterator>
+    std::vector<Point> sorted_maxima(Iterator first, Iterator last){
+        return sorted_extrema<Point, false>(first, last);
+    }
+
+    // Returns the local minima in the order given by compare_minima, see sorted_maxima.
+    template<typename Point, typename Iterator>
+    std::vector<Point> sorted_minima(Iterator first, Iterator last){
+        return sorted_extrema<Point, true>(first, last);
+    }
+
+    // Runs body(i) for every i from [0, count), each on a thread of its own, the
+    // calling one included. The first exception thrown by body, or by starting a
+    // thread, is passed on once all the threads have finished.
+    template<typename Body>
+    void parallel_for(std::size_t count, Body body){
+        std::vector<std::exception_ptr> errors(count);
+        std::vector<std::thread> threads;
+        auto run = [&](std::size_t i){
+            try {
+                body(i);
+            }
+            catch(...) {
+                errors[i] = std::current_exception();
+            }
+        };
+        try {
+            threads.reserve(count);
+            for(std::size_t i = 1; i < count; i++) {
+                threads.emplace_back(run, i);
+            }
+        }
+        catch(...) {
+            for(std::thread& t : threads) {
+                t.join();
+            }
+            throw;
+        }
+        if(count > 0) run(0);
+        for(std::thread& t : threads) {
+            t.join();
+        }
+        for(const std::exception_ptr& error : errors) {
+            if(error) std::rethrow_exception(error);
+        }
+    }
+
+    // Same as sorted_extrema for points in an array, split between the given number
+    // of threads. Each of them sweeps a chunk of the array, looking only at the
+    // neighbours of its points, and sorts the extrema found there, then the sorted
+    // chunks are merged in pairs, also in parallel. Only the points of its own chunk
+    // are copied by a thread, so the reference counters need not be atomic.
+    template<typename Point, bool Minimum>
+    std::vector<Point> parallel_sorted_extrema(const std::vector<Point>& points, std::size_t threads){
+        using Compare = compare_extrema<Point, Minimum>;
+        // Smaller chunks are not worth starting a thread for.
+        const std::size_t min_chunk = 4096;
+        std::size_t n = points.size();
+        std::size_t chunks = std::max<std::size_t>(1, std::min(threads, n / min_chunk));
+        std::vector<std::vector<Point>> parts(chunks);
+        parallel_for(chunks, [&](std::size_t c){
+            append_extrema<Minimum>(points.begin(), n, n * c / chunks, n * (c + 1) / chunks, parts[c]);
+            std::sort(parts[c].begin(), parts[c].end(), Compare());
+        });
+        while(parts.size() > 1) {
+            std::vector<std::vector<Point>> merged(parts.size() / 2);
+            parallel_for(merged.size(), [&](std::size_t c){
+                std::vector<Point>& lhs = parts[2 * c];
+                std::vector<Point>& rhs = parts[2 * c + 1];
+                merged[c].reserve(lhs.size() + rhs.size());
+                std::merge(std::make_move_iterator(lhs.begin()), std::make_move_iterator(lhs.end()),
+                           std::make_move_iterator(rhs.begin()), std::make_move_iterator(rhs.end()),
+                           std::back_inserter(merged[c]), Compare());
+            });
+            if(parts.size() % 2 == 1) merged.push_back(std::move(parts.back()));
+            parts.swap(merged);
+        }
+        return std::move(parts[0]);
+    }
+
+    template<typename Point>
+    std::vector<Point> parallel_sorted_maxima(const std::vector<Point>& points, std::size_t threads){
+        return parallel_sorted_extrema<Point, false>(points, threads);
+    }
+
+    template<typename Point>
+    std::vector<Point> parallel_sorted_minima(const std::vector<Point>& points, std::size_t threads){
+        return parallel_sorted_extrema<Point, true>(points, threads);
+    }
+
+    template<typename V>
+    bool equivalent(V const& v1, V const& v2){
+        if(v1 < v2) return false;
+        if(v2 < v1) return false;
+        return true;
+    }
+
+    // Sorted multiset kept in a B+ tree: elements live contiguously in wide leaves
+    // linked into a list, inner nodes only route the searches. Equal elements are
+    // inserted after the existing ones, like in std::multiset.
+    //
+    // Inserting and erasing invalidate the iterators. Elements must be no-throw
+    // copyable and movable (copies of them are kept as separators in inner nodes).
+    // Insertions have Strong Guarantee, erasing is no-throw.
+    // Nodes are allocated by a default-constructed Allocator rebound to their types.
+    template<typename T, typename Compare, typename Allocator = std::allocator<T>>
+    class bplus_multiset{
+
+        static_assert(std::is_nothrow_move_constructible<T>::value &&
+                      std::is_nothrow_copy_constructible<T>::value &&
+                      std::is_nothrow_copy_assignable<T>::value,
+                      "elements of a bplus_multiset must be no-throw copyable");
+
+        static constexpr std::size_t node_bytes = 512;
+        static constexpr std::size_t leaf_capacity =
+            node_bytes / sizeof(T) < 4 ? 4 : node_bytes / sizeof(T);
+        static constexpr std::size_t inner_capacity =
+            node_bytes / (sizeof(T) + sizeof(void*)) < 4 ? 4 : node_bytes / (sizeof(T) + sizeof(void*));
+        static constexpr std::size_t leaf_minimum = leaf_capacity / 2;
+        static constexpr std::size_t inner_minimum = inner_capacity / 2;
+
+        // Uninitialised room for N elements.
+        template<std::size_t N>
+        struct slots{
+            alignas(T) unsigned char raw[N * sizeof(T)];
+
+            T* data() noexcept{
+                return std::launder(reinterpret_cast<T*>(raw));
+            }
+
+            const T* data() const noexcept{
+                return std::launder(reinterpret_cast<const T*>(raw));
+            }
+
+            T& operator[](std::size_t i) noexcept{
+                return data()[i];
+            }
+
+            const T& operator[](std::size_t i) const noexcept{
+                return data()[i];
+            }
+        };
+
+        struct inner_node;
+
+        struct node{
+            inner_node* parent = nullptr;
+            // Number of elements in a leaf, number of children in an inner node.
+            std::size_t count = 0;
+            bool is_leaf;
+
+            explicit node(bool leaf): is_leaf(leaf) {}
+        };
+
+        struct leaf_node : node{
+            leaf_node* prev = nullptr;
+            leaf_node* next = nullptr;
+            slots<leaf_capacity> items;
+
+            leaf_node(): node(true) {}
+        };
+
+        // separators[i] is the first element of the subtree children[i + 1].
+        struct inner_node : node{
+            node* children[inner_capacity];
+            slots<inner_capacity - 1> separators;
+
+            inner_node(): node(false) {}
+        };
+
+        template<typename Node>
+        static Node* make_node(){
+            using allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+            allocator alloc;
+            Node* n = std::allocator_traits<allocator>::allocate(alloc, 1);
+            return ::new (static_cast<void*>(n)) Node();
+        }
+
+        // No-throw, does nothing for nullptr.
+        template<typename Node>
+        static void free_node(Node* n) noexcept{
+            using allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+            if(n == nullptr) return;
+            allocator alloc;
+            n->~Node();
+            std::allocator_traits<allocator>::deallocate(alloc, n, 1);
+        }
+
+        // Moves the element from src into uninitialised dst.
+        static void relocate(T* dst, T* src) noexcept{
+            ::new (static_cast<void*>(dst)) T(std::move(*src));
+            src->~T();
+        }
+
+        // Makes room at position pos of an array holding count elements.
+        static void open_slot(T* base, std::size_t count, std::size_t pos) noexcept{
+            for(std::size_t i = count; i > pos; i--) {
+                relocate(base + i, base + i - 1);
+            }
+        }
+
+        // Removes the (already destroyed) element at position pos.
+        static void close_slot(T* base, std::size_t count, std::size_t pos) noexcept{
+            for(std::size_t i = pos; i + 1 < count; i++) {
+                relocate(base + i, base + i + 1);
+            }
+        }
+
+        static void relocate_range(T* dst, T* src, std::size_t n) noexcept{
+            for(std::size_t i = 0; i < n; i++) {
+                relocate(dst + i, src + i);
+            }
+        }
+
+        static void destroy(node* n) noexcept{
+            if(n == nullptr) return;
+            if(n->is_leaf) {
+                leaf_node* leaf = static_cast<leaf_node*>(n);
+                for(std::size_t i = 0; i < leaf->count; i++) {
+                    leaf->items[i].~T();
+                }
+                free_node(leaf);
+            }
+            else {
+                inner_node* inner = static_cast<inner_node*>(n);
+                for(std::size_t i = 0; i < inner->count; i++) {
+                    if(i > 0) inner->separators[i - 1].~T();
+                    destroy(inner->children[i]);
+                }
+                free_node(inner);
+            }
+        }
+
+        static std::size_t index_in_parent(const node* n) noexcept{
+            const inner_node* parent = n->parent;
+            std::size_t i = 0;
+            while(parent->children[i] != n) i++;
+            return i;
+        }
+
+        node* root;
+        leaf_node* first;
+        leaf_node* last;
+        std::size_t elements;
+        Compare compare;
+
+    public:
+
+        using value_type = T;
+        using size_type = std::size_t;
+        using difference_type = std::ptrdiff_t;
+        using key_compare = Compare;
+
+        class const_iterator{
+
+            leaf_node* leaf;
+            std::size_t index;
+
+            const_iterator(leaf_node* l, std::size_t i): leaf(l), index(i) {}
+
+            friend class bplus_multiset;
+
+        public:
+
+            using iterator_category = std::bidirectional_iterator_tag;
+            using value_type = T;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const T*;
+            using reference = const T&;
+
+            const_iterator(): leaf(nullptr), index(0) {}
+
+            reference operator*() const{
+                return leaf->items[index];
+            }
+
+            pointer operator->() const{
+                return &leaf->items[index];
+            }
+
+            const_iterator& operator++(){
+                if(++index == leaf->count && leaf->next != nullptr) {
+                    leaf = leaf->next;
+                    index = 0;
+                }
+                return *this;
+            }
+
+            const_iterator operator++(int){
+                const_iterator result = *this;
+                ++*this;
+                return result;
+            }
+
+            const_iterator& operator--(){
+                if(index == 0) {
+                    leaf = leaf->prev;
+                    index = leaf->count;
+                }
+                --index;
+                return *this;
+            }
+
+            const_iterator operator--(int){
+                const_iterator result = *this;
+                --*this;
+                return result;
+            }
+
+            bool operator==(const const_iterator& rhs) const{
+                return leaf == rhs.leaf && index == rhs.index;
+            }
+
+            bool operator!=(const const_iterator& rhs) const{
+                return !(*this == rhs);
+            }
+        };
+
+        using iterator = const_iterator;
+
+        bplus_multiset(): root(nullptr), first(nullptr), last(nullptr), elements(0), compare() {}
+
+        bplus_multiset(const bplus_multiset& rhs):
+        root(nullptr),
+        first(nullptr),
+        last(nullptr),
+        elements(0),
+        compare(rhs.compare)
+        {
+            if(rhs.root == nullptr) return;
+            leaf_node* previous = nullptr;
+            root = clone(rhs.root, nullptr, previous);
+            last = previous;
+            elements = rhs.elements;
+        }
+
+        bplus_multiset(bplus_multiset&& rhs) noexcept: bplus_multiset() {
+            swap(rhs);
+        }
+
+        bplus_multiset& operator=(const bplus_multiset& rhs){
+            if(this == &rhs){
+                return *this;
+            }
+            bplus_multiset temp(rhs);
+            temp.swap(*this);
+            return *this;
+        }
+
+        bplus_multiset& operator=(bplus_multiset&& rhs) noexcept{
+            bplus_multiset temp(std::move(rhs));
+            temp.swap(*this);
+            return *this;
+        }
+
+        ~bplus_multiset(){
+            destroy(root);
+        }
+
+        void swap(bplus_multiset& rhs) noexcept{
+            std::swap(root, rhs.root);
+            std::swap(first, rhs.first);
+            std::swap(last, rhs.last);
+            std::swap(elements, rhs.elements);
+            std::swap(compare, rhs.compare);
+        }
+
+        const_iterator begin() const noexcept{
+            return const_iterator(first, 0);
+        }
+
+        const_iterator end() const noexcept{
+            return const_iterator(last, last == nullptr ? 0 : last->count);
+        }
+
+        size_type size() const noexcept{
+            return elements;
+        }
+
+        bool empty() const noexcept{
+            return elements == 0;
+        }
+
+        template<typename K>
+        const_iterator lower_bound(const K& key) const{
+            return search(key, [this](const T& separator, const K& k){
+                return compare(separator, k);
+            });
+        }
+
+        template<typename K>
+        const_iterator upper_bound(const K& key) const{
+            return search(key, [this](const T& separator, const K& k){
+                return !compare(k, separator);
+            });
+        }
+
+        template<typename K>
+        const_iterator find(const K& key) const{
+            const_iterator it = lower_bound(key);
+            if(it == end() || compare(key, *it)) return end();
+            return it;
+        }
+
+        const_iterator insert(const T& value){
+            T copy(value);
+            return insert(std::move(copy));
+        }
+
+        // Replaces the element at pos with value, which must be equivalent to it,
+        // together with its copy kept as a separator, if any. No-throw.
+        void replace(const_iterator pos, const T& value) noexcept{
+            pos.leaf->items[pos.index] = value;
+            if(pos.index != 0) return;
+            for(node* n = pos.leaf; n->parent != nullptr; n = n->parent) {
+                std::size_t i = index_in_parent(n);
+                if(i > 0) {
+                    n->parent->separators[i - 1] = value;
+                    return;
+                }
+            }
+        }
+
+        const_iterator insert(T&& value){
+            if(root == nullptr) {
+                leaf_node* leaf = make_node<leaf_node>();
+                ::new (static_cast<void*>(leaf->items.data())) T(std::move(value));
+                leaf->count = 1;
+                root = first = last = leaf;
+                elements = 1;
+                return begin();
+            }
+            const_iterator position = upper_bound(value);
+            if(position.index == 0 && position.leaf->prev != nullptr) {
+                // Keep the element in the leaf the search descended to.
+                --position;
+                ++position.index;
+            }
+            return insert_at(position.leaf, position.index, std::move(value));
+        }
+
+        // Inserts value as close as possible before hint. Takes amortised constant
+        // time if value belongs there (in particular when appending at the end),
+        // otherwise falls back to the ordinary insert.
+        const_iterator insert(const_iterator hint, const T& value){
+            T copy(value);
+            return insert(hint, std::move(copy));
+        }
+
+        const_iterator insert(const_iterator hint, T&& value){
+            if(root == nullptr) return insert(std::move(value));
+            if(hint != end() && compare(*hint, value)) return insert(std::move(value));
+            if(hint != begin() && compare(value, *std::prev(hint))) return insert(std::move(value));
+            if(hint.index == 0 && hint.leaf->prev != nullptr) {
+                // Keep the separator in front of hint's leaf valid.
+                --hint;
+                ++hint.index;
+            }
+            return insert_at(hint.leaf, hint.index, std::move(value));
+        }
+
+        // No-throw. Returns the iterator following the erased element.
+        const_iterator erase(const_iterator pos) noexcept{
+            leaf_node* leaf = pos.leaf;
+            std::size_t index = pos.index;
+            leaf->items[index].~T();
+            close_slot(leaf->items.data(), leaf->count, index);
+            leaf->count--;
+            elements--;
+
+            if(leaf == root) {
+                if(leaf->count == 0) {
+                    free_node(leaf);
+                    root = first = last = nullptr;
+                    return end();
+                }
+                return normalize(leaf, index);
+            }
+
+            if(index == 0) refresh_separator(leaf);
+            if(leaf->count < leaf_minimum) rebalance_leaf(leaf, index);
+            return normalize(leaf, index);
+        }
+
+        // No-throw. Erases the elements of [first, last). Rebalancing invalidates
+        // last, so the elements are counted before any of them is erased.
+        const_iterator erase(const_iterator first, const_iterator last) noexcept{
+            std::size_t count = 0;
+            for(const_iterator it = first; it != last; ++it) {
+                count++;
+            }
+            for(; count > 0; count--) {
+                first = erase(first);
+            }
+            return first;
+        }
+
+    private:
+
+        // Finds the position of the first element e such that !before(e, key).
+        template<typename K, typename Before>
+        const_iterator search(const K& key, Before before) const{
+            if(root == nullptr) return end();
+            const node* n = root;
+            while(!n->is_leaf) {
+                const inner_node* inner = static_cast<const inner_node*>(n);
+                n = inner->children[partition(inner->separators.data(), inner->count - 1, key, before)];
+            }
+            leaf_node* leaf = static_cast<leaf_node*>(const_cast<node*>(n));
+            return normalize(leaf, partition(leaf->items.data(), leaf->count, key, before));
+        }
+
+        // Binary search for the number of leading elements e such that before(e, key).
+        template<typename K, typename Before>
+        static std::size_t partition(const T* items, std::size_t count, const K& key, Before before){
+            std::size_t low = 0;
+            std::size_t high = count;
+            while(low < high) {
+                std::size_t middle = (low + high) / 2;
+                if(before(items[middle], key)) low = middle + 1;
+                else high = middle;
+            }
+            return low;
+        }
+
+        const_iterator normalize(leaf_node* leaf, std::size_t index) const noexcept{
+            if(index == leaf->count && leaf->next != nullptr) {
+                return const_iterator(leaf->next, 0);
+            }
+            return const_iterator(leaf, index);
+        }
+
+        node* clone(const node* n, inner_node* parent, leaf_node*& previous){
+            if(n->is_leaf) {
+                const leaf_node* source = static_cast<const leaf_node*>(n);
+                leaf_node* leaf = make_node<leaf_node>();
+                for(std::size_t i = 0; i < source->count; i++) {
+                    ::new (static_cast<void*>(leaf->items.data() + i)) T(source->items[i]);
+                }
+                leaf->count = source->count;
+                leaf->parent = parent;
+                leaf->prev = previous;
+                if(previous == nullptr) first = leaf;
+                else previous->next = leaf;
+                previous = leaf;
+                return leaf;
+            }
+            const inner_node* source = static_cast<const inner_node*>(n);
+            inner_node* inner = make_node<inner_node>();
+            inner->parent = parent;
+            try {
+                for(std::size_t i = 0; i < source->count; i++) {
+                    node* child = clone(source->children[i], inner, previous);
+                    if(i > 0) {
+                        ::new (static_cast<void*>(inner->separators.data() + i - 1))
+                            T(source->separators[i - 1]);
+                    }
+                    inner->children[i] = child;
+                    inner->count = i + 1;
+                }
+            }
+            catch(...) {
+                destroy(inner);
+                throw;
+            }
+            return inner;
+        }
+
+        // Inserts value at position index of leaf, splitting the nodes on the way up
+        // when they are full. All nodes are allocated before the tree is modified.
+        const_iterator insert_at(leaf_node* leaf, std::size_t index, T&& value){
+            std::size_t splits = 0;
+            bool new_root = false;
+            if(leaf->count == leaf_capacity) {
+                splits = 1;
+                inner_node* n = leaf->parent;
+                while(n != nullptr && n->count == inner_capacity) {
+                    splits++;
+                    n = n->parent;
+                }
+                new_root = n == nullptr;
+            }
+
+            leaf_node* new_leaf = nullptr;
+            inner_node* spare[64];
+            std::size_t allocated = 0;
+            std::size_t needed = splits == 0 ? 0 : splits - 1 + (new_root ? 1 : 0);
+            try {
+                if(splits > 0) new_leaf = make_node<leaf_node>();
+                for(; allocated < needed; allocated++) {
+                    spare[allocated] = make_node<inner_node>();
+                }
+            }
+            catch(...) {
+                free_node(new_leaf);
+                for(std::size_t i = 0; i < allocated; i++) free_node(spare[i]);
+                throw;
+            }
+
+            elements++;
+            if(splits == 0) {
+                open_slot(leaf->items.data(), leaf->count, index);
+                ::new (static_cast<void*>(leaf->items.data() + index)) T(std::move(value));
+                leaf->count++;
+                return const_iterator(leaf, index);
+            }
+
+            // Split the leaf: the combined sequence of leaf_capacity + 1 elements is
+            // divided between leaf and new_leaf.
+            std::size_t total = leaf_capacity + 1;
+            std::size_t left = total / 2;
+            const_iterator result;
+            if(index < left) {
+                relocate_range(new_leaf->items.data(), leaf->items.data() + left - 1, total - left);
+                open_slot(leaf->items.data(), left - 1, index);
+                ::new (static_cast<void*>(leaf->items.data() + index)) T(std::move(value));
+                result = const_iterator(leaf, index);
+            }
+            else {
+                std::size_t moved = leaf_capacity - left;
+                relocate_range(new_leaf->items.data(), leaf->items.data() + left, index - left);
+                ::new (static_cast<void*>(new_leaf->items.data() + index - left)) T(std::move(value));
+                relocate_range(new_leaf->items.data() + index - left + 1,
+                               leaf->items.data() + index, moved - (index - left));
+                result = const_iterator(new_leaf, index - left);
+            }
+            leaf->count = left;
+            new_leaf->count = total - left;
+            new_leaf->prev = leaf;
+            new_leaf->next = leaf->next;
+            if(leaf->next != nullptr) leaf->next->prev = new_leaf;
+            else last = new_leaf;
+            leaf->next = new_leaf;
+
+            insert_child(leaf, new_leaf, T(new_leaf->items[0]), spare);
+            return result;
+        }
+
+        // Puts right just after left in the parent of left, with the given separator.
+        // Uses the preallocated nodes from spare if the parents have to be split.
+        void insert_child(node* left, node* right, T&& separator, inner_node** spare) noexcept{
+            inner_node* parent = left->parent;
+            if(parent == nullptr) {
+                inner_node* top = *spare;
+                top->children[0] = left;
+                top->children[1] = right;
+                ::new (static_cast<void*>(top->separators.data())) T(std::move(separator));
+                top->count = 2;
+                left->parent = right->parent = top;
+                root = top;
+                return;
+            }
+
+            std::size_t pos = index_in_parent(left) + 1;
+            if(parent->count < inner_capacity) {
+                insert_into_inner(parent, pos, right, std::move(separator));
+                return;
+            }
+
+            // Split the parent. Children and separators are gathered in temporary
+            // arrays with the new one in place, then divided between two nodes.
+            node* children[inner_capacity + 1];
+            slots<inner_capacity> separators;
+            std::size_t total = inner_capacity + 1;
+            for(std::size_t i = 0, j = 0; i < total; i++) {
+                children[i] = i == pos ? right : parent->children[j++];
+            }
+            relocate_range(separators.data(), parent->separators.data(), pos - 1);
+            ::new (static_cast<void*>(separators.data() + pos - 1)) T(std::move(separator));
+            relocate_range(separators.data() + pos, parent->separators.data() + pos - 1,
+                           inner_capacity - pos);
+
+            inner_node* sibling = *spare++;
+            std::size_t left_count = total / 2;
+            for(std::size_t i = 0; i < left_count; i++) {
+                parent->children[i] = children[i];
+                children[i]->parent = parent;
+            }
+            relocate_range(parent->separators.data(), separators.data(), left_count - 1);
+            for(std::size_t i = left_count; i < total; i++) {
+                sibling->children[i - left_count] = children[i];
+                children[i]->parent = sibling;
+            }
+            relocate_range(sibling->separators.data(), separators.data() + left_count,
+                           total - left_count - 1);
+            parent->count = left_count;
+            sibling->count = total - left_count;
+
+            T middle(std::move(separators[left_count - 1]));
+            separators[left_count - 1].~T();
+            insert_child(parent, sibling, std::move(middle), spare);
+        }
+
+        static void insert_into_inner(inner_node* inner, std::size_t pos, node* child,
+                                      T&& separator) noexcept{
+            for(std::size_t i = inner->count; i > pos; i--) {
+                inner->children[i] = inner->children[i - 1];
+            }
+            inner->children[pos] = child;
+            open_slot(inner->separators.data(), inner->count - 1, pos - 1);
+            ::new (static_cast<void*>(inner->separators.data() + pos - 1)) T(std::move(separator));
+            inner->count++;
+            child->parent = inner;
+        }
+
+        // Removes the child at position pos (> 0) and the separator preceding it.
+        static void remove_from_inner(inner_node* inner, std::size_t pos) noexcept{
+            inner->separators[pos - 1].~T();
+            close_slot(inner->separators.data(), inner->count - 1, pos - 1);
+            for(std::size_t i = pos; i + 1 < inner->count; i++) {
+                inner->children[i] = inner->children[i + 1];
+            }
+            inner->count--;
+        }
+
+        // Updates the separator in front of the subtree whose first leaf is leaf,
+        // after its first element has changed.
+        void refresh_separator(leaf_node* leaf) noexcept{
+            node* child = leaf;
+            inner_node* parent = leaf->parent;
+            while(parent != nullptr && parent->children[0] == child) {
+                child = parent;
+                parent = parent->parent;
+            }
+            if(parent != nullptr) {
+                parent->separators[index_in_parent(child) - 1] = leaf->items[0];
+            }
+        }
+
+        // Restores the minimal fill of leaf after an erase. index is the position of
+        // the element following the erased one and is updated if elements move.
+        void rebalance_leaf(leaf_node*& leaf, std::size_t& index) noexcept{
+            inner_node* parent = leaf->parent;
+            std::size_t pos = index_in_parent(leaf);
+            leaf_node* left = pos > 0 ? static_cast<leaf_node*>(parent->children[pos - 1]) : nullptr;
+            leaf_node* right = pos + 1 < parent->count
+                               ? static_cast<leaf_node*>(parent->children[pos + 1]) : nullptr;
+
+            if(left != nullptr && left->count > leaf_minimum) {
+                open_slot(leaf->items.data(), leaf->count, 0);
+                relocate(leaf->items.data(), left->items.data() + left->count - 1);
+                left->count--;
+                leaf->count++;
+                index++;
+                parent->separators[pos - 1] = leaf->items[0];
+                return;
+            }
+            if(right != nullptr && right->count > leaf_minimum) {
+                relocate(leaf->items.data() + leaf->count, right->items.data());
+                close_slot(right->items.data(), right->count, 0);
+                right->count--;
+                leaf->count++;
+                parent->separators[pos] = right->items[0];
+                return;
+            }
+
+            if(left != nullptr) {
+                relocate_range(left->items.data() + left->count, leaf->items.data(), leaf->count);
+                index += left->count;
+                left->count += leaf->count;
+                unlink(leaf);
+                remove_from_inner(parent, pos);
+                free_node(leaf);
+                leaf = left;
+            }
+            else {
+                relocate_range(leaf->items.data() + leaf->count, right->items.data(), right->count);
+                leaf->count += right->count;
+                unlink(right);
+                remove_from_inner(parent, pos + 1);
+                free_node(right);
+            }
+            rebalance_inner(parent);
+        }
+
+        void unlink(leaf_node* leaf) noexcept{
+            if(leaf->prev != nullptr) leaf->prev->next = leaf->next;
+            else first = leaf->next;
+            if(leaf->next != nullptr) leaf->next->prev = leaf->prev;
+            else last = leaf->prev;
+        }
+
+        void rebalance_inner(inner_node* inner) noexcept{
+            inner_node* parent = inner->parent;
+            if(parent == nullptr) {
+                if(inner->count == 1) {
+                    root = inner->children[0];
+                    root->parent = nullptr;
+                    free_node(inner);
+                }
+                return;
+            }
+            if(inner->count >= inner_minimum) return;
+
+            std::size_t pos = index_in_parent(inner);
+            inner_node* left = pos > 0 ? static_cast<inner_node*>(parent->children[pos - 1]) : nullptr;
+            inner_node* right = pos + 1 < parent->count
+                                ? static_cast<inner_node*>(parent->children[pos + 1]) : nullptr;
+
+            if(left != nullptr && left->count > inner_minimum) {
+                // The last child of left goes to the front of inner, the separators
+                // rotate through the parent.
+                for(std::size_t i = inner->count; i > 0; i--) {
+                    inner->children[i] = inner->children[i - 1];
+                }
+                inner->children[0] = left->children[left->count - 1];
+                inner->children[0]->parent = inner;
+                open_slot(inner->separators.data(), inner->count - 1, 0);
+                relocate(inner->separators.data(), parent->separators.data() + pos - 1);
+                relocate(parent->separators.data() + pos - 1, left->separators.data() + left->count - 2);
+                left->count--;
+                inner->count++;
+                return;
+            }
+            if(right != nullptr && right->count > inner_minimum) {
+                inner->children[inner->count] = right->children[0];
+                inner->children[inner->count]->parent = inner;
+                relocate(inner->separators.data() + inner->count - 1, parent->separators.data() + pos);
+                relocate(parent->separators.data() + pos, right->separators.data());
+                close_slot(right->separators.data(), right->count - 1, 0);
+                for(std::size_t i = 0; i + 1 < right->count; i++) {
+                    right->children[i] = right->children[i + 1];
+                }
+                right->count--;
+                inner->count++;
+                return;
+            }
+
+            if(left != nullptr) {
+                merge_inner(left, inner, pos);
+            }
+            else {
+                merge_inner(inner, right, pos + 1);
+            }
+            rebalance_inner(parent);
+        }
+
+        // Appends the children of right (the child at position pos of their parent)
+        // to left, together with the separator between them.
+        void merge_inner(inner_node* left, inner_node* right, std::size_t pos) noexcept{
+            inner_node* parent = left->parent;
+            relocate(left->separators.data() + left->count - 1, parent->separators.data() + pos - 1);
+            close_slot(parent->separators.data(), parent->count - 1, pos - 1);
+            for(std::size_t i = pos; i + 1 < parent->count; i++) {
+                parent->children[i] = parent->children[i + 1];
+            }
+            parent->count--;
+            relocate_range(left->separators.data() + left->count, right->separators.data(),
+                           right->count - 1);
+            for(std::size_t i = 0; i < right->count; i++) {
+                left->children[left->count + i] = right->children[i];
+                right->children[i]->parent = left;
+            }
+            left->count += right->count;
+            free_node(right);
+        }
+
+    };
+
+    // Sorted set of unique elements kept in an immutable AVL tree, whose nodes are
+    // shared between the versions of the set. Copying a set takes O(1) time. inserted
+    // and erased copy the O(log n) nodes on the path to the element and return the new
+    // version, leaving the set itself untouched, so they have Strong Guarantee. Nodes
+    // count their references through the Policy, like the points of FunctionMaxima,
+    // and are allocated by its allocator rebound to their type.
+    template<typename T, typename Compare, typename Policy>
+    class persistent_set{
+
+        struct node{
+            T value;
+            const node* left;
+            const node* right;
+            std::size_t size;
+            int height;
+            mutable typename Policy::counter_type references;
+
+            // Takes references to both children.
+            node(const T& v, const node* l, const node* r):
+            value(v), left(share(l)), right(share(r)),
+            size(count(l) + count(r) + 1),
+            height(std::max(depth(l), depth(r)) + 1),
+            references(1)
+            {}
+        };
+
+        // Owns a single reference to a tree.
+        class link{
+        public:
+            explicit link(const node* n = nullptr) noexcept: n(n) {}
+
+            link(const link& rhs) noexcept: n(share(rhs.n)) {}
+
+            link(link&& rhs) noexcept: n(rhs.n){
+                rhs.n = nullptr;
+            }
+
+            link& operator=(link rhs) noexcept{
+                std::swap(n, rhs.n);
+                return *this;
+            }
+
+            ~link(){
+                release(n);
+            }
+
+            const node* get() const noexcept{
+                return n;
+            }
+
+        private:
+            const node* n;
+        };
+
+        static const node* share(const node* n) noexcept{
+            if(n != nullptr) Policy::increment(n->references);
+            return n;
+        }
+
+        using node_allocator = typename std::allocator_traits<
+            typename Policy::template allocator<T>>::template rebind_alloc<node>;
+
+        static void release(const node* n) noexcept{
+            if(n != nullptr && Policy::decrement(n->references)) {
+                release(n->left);
+                release(n->right);
+                node* target = const_cast<node*>(n);
+                node_allocator alloc;
+                target->~node();
+                std::allocator_traits<node_allocator>::deallocate(alloc, target, 1);
+            }
+        }
+
+        static std::size_t count(const node* n) noexcept{
+            return n == nullptr ? 0 : n->size;
+        }
+
+        static int depth(const node* n) noexcept{
+            return n == nullptr ? 0 : n->height;
+        }
+
+        static link make(const node* l, const T& v, const node* r){
+            node_allocator alloc;
+            node* n = std::allocator_traits<node_allocator>::allocate(alloc, 1);
+            try {
+                ::new (static_cast<void*>(n)) node(v, l, r);
+            }
+            catch(...) {
+                std::allocator_traits<node_allocator>::deallocate(alloc, n, 1);
+                throw;
+            }
+            return link(n);
+        }
+
+        // Joins two trees and an element between them, whose heights differ by at
+        // most 2, into a balanced tree.
+        static link balance(const node* l, const T& v, const node* r){
+            int hl = depth(l);
+            int hr = depth(r);
+            if(hl > hr + 1) {
+                if(depth(l->left) >= depth(l->right)) {
+                    return make(l->left, l->value, make(l->right, v, r).get());
+                }
+                const node* lr = l->right;
+                return make(make(l->left, l->value, lr->left).get(), lr->value,
+                            make(lr->right, v, r).get());
+            }
+            if(hr > hl + 1) {
+                if(depth(r->right) >= depth(r->left)) {
+                    return make(make(l, v, r->left).get(), r->value, r->right);
+                }
+                const node* rl = r->left;
+                return make(make(l, v, rl->left).get(), rl->value,
+                            make(rl->right, r->value, r->right).get());
+            }
+            return make(l, v, r);
+        }
+
+        // Replaces an element equivalent to x if there is one.
+        static link insert(const node* n, const T& x){
+            if(n == nullptr) return make(nullptr, x, nullptr);
+            if(Compare()(x, n->value)) return balance(insert(n->left, x).get(), n->value, n->right);
+            if(Compare()(n->value, x)) return balance(n->left, n->value, insert(n->right, x).get());
+            return make(n->left, x, n->right);
+        }
+
+        static const node* leftmost(const node* n) noexcept{
+            while(n->left != nullptr) n = n->left;
+            return n;
+        }
+
+        static link erase_leftmost(const node* n){
+            if(n->left == nullptr) return link(share(n->right));
+            return balance(erase_leftmost(n->left).get(), n->value, n->right);
+        }
+
+        // The element equivalent to key must be present.
+        template<typename K>
+        static link erase(const node* n, const K& key){
+            if(Compare()(key, n->value)) return balance(erase(n->left, key).get(), n->value, n->right);
+            if(Compare()(n->value, key)) return balance(n->left, n->value, erase(n->right, key).get());
+            if(n->left == nullptr) return link(share(n->right));
+            if(n->right == nullptr) return link(share(n->left));
+            return balance(n->left, leftmost(n->right)->value, erase_leftmost(n->right).get());
+        }
+
+        static link build(const T* first, std::size_t n){
+            if(n == 0) return link();
+            std::size_t middle = n / 2;
+            return make(build(first, middle).get(), first[middle],
+                        build(first + middle + 1, n - middle - 1).get());
+        }
+
+        link root;
+
+        explicit persistent_set(link root) noexcept: root(std::move(root)) {}
+
+    public:
+
+        // Enough for an AVL tree of any number of elements that fits in memory.
+        static constexpr int max_height = 96;
+
+        // Keeps the current node, null at the end, the nearest of its ancestors and
+        // the turns taken on the way to it from the root. A neighbour is found among
+        // the ancestors kept nearly always, and otherwise they are found again by
+        // following the turns, so the iterator stays small and moving it compares no
+        // elements. Valid as long as a version containing the node exists.
+        class const_iterator{
+        public:
+            using iterator_category = std::bidirectional_iterator_tag;
+            using value_type = T;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const T*;
+            using reference = const T&;
+
+            const_iterator() noexcept = default;
+
+            reference operator*() const noexcept{
+                return current->value;
+            }
+
+            pointer operator->() const noexcept{
+                return &current->value;
+            }
+
+            // Takes O(1) amortized time when iterating over the set, O(log n) at most.
+            const_iterator& operator++() noexcept{
+                if(current->right != nullptr) {
+                    descend(true);
+                    while(current->left != nullptr) descend(false);
+                    return *this;
+                }
+                for(const node* child = current;; child = current) {
+                    if(depth == 0) {
+                        current = nullptr;
+                        return *this;
+                    }
+                    ascend();
+                    if(current->left == child) return *this;
+                }
+            }
+
+            const_iterator operator++(int) noexcept{
+                const_iterator result(*this);
+                ++*this;
+                return result;
+            }
+
+            const_iterator& operator--() noexcept{
+                if(current == nullptr) {
+                    current = root;
+                    depth = kept = 0;
+                    while(current->right != nullptr) descend(true);
+                    return *this;
+                }
+                if(current->left != nullptr) {
+                    descend(false);
+                    while(current->right != nullptr) descend(true);
+                    return *this;
+                }
+                for(const node* child = current;; child = current) {
+                    ascend();
+                    if(current->right == child) return *this;
+                }
+            }
+
+            const_iterator operator--(int) noexcept{
+                const_iterator result(*this);
+                --*this;
+                return result;
+            }
+
+            bool operator==(const const_iterator& rhs) const noexcept{
+                return current == rhs.current;
+            }
+
+            bool operator!=(const const_iterator& rhs) const noexcept{
+                return !(*this == rhs);
+            }
+
+        private:
+            static constexpr unsigned window = 8;
+
+            explicit const_iterator(const node* root) noexcept: root(root) {}
+
+            bool turn(unsigned level) const noexcept{
+                return (turns[level / 64] >> level % 64) & 1;
+            }
+
+            void set_turn(unsigned level, bool right) noexcept{
+                std::uint64_t bit = std::uint64_t(1) << level % 64;
+                turns[level / 64] = right ? turns[level / 64] | bit : turns[level / 64] & ~bit;
+            }
+
+            void descend(bool right) noexcept{
+                ancestors[depth % window] = current;
+                set_turn(depth, right);
+                depth++;
+                kept = std::min(kept + 1, window);
+                current = right ? current->right : current->left;
+            }
+
+            // Finds the ancestors of the current node again if none is kept.
+            void ascend() noexcept{
+                if(kept == 0) {
+                    unsigned target = depth;
+                    current = root;
+                    depth = 0;
+                    while(depth < target) descend(turn(depth));
+                }
+                depth--;
+                kept--;
+                current = ancestors[depth % window];
+            }
+
+            const node* root = nullptr;
+            const node* current = nullptr;
+            // The ancestor at level d is kept at d % window, for the last kept levels.
+            const node* ancestors[window];
+            std::uint64_t turns[(max_height + 63) / 64] = {};
+            unsigned depth = 0;
+            unsigned kept = 0;
+
+            friend class persistent_set;
+        };
+
+        persistent_set() noexcept = default;
+
+        // Builds the set from a sorted array of unique elements in O(n) time.
+        // Strong Guarantee.
+        static persistent_set from_sorted(const std::vector<T>& elements){
+            return persistent_set(build(elements.data(), elements.size()));
+        }
+
+        // The set with x added, or replacing the element equivalent to it.
+        persistent_set inserted(const T& x) const{
+            return persistent_set(insert(root.get(), x));
+        }
+
+        // The set without the element equivalent to key, which must be present.
+        template<typename K>
+        persistent_set erased(const K& key) const{
+            return persistent_set(erase(root.get(), key));
+        }
+
+        // The first element not less than key. Strong Guarantee.
+        template<typename K>
+        const_iterator lower_bound(const K& key) const{
+            const_iterator it(root.get());
+            const node* found = nullptr;
+            unsigned found_depth = 0;
+            unsigned depth = 0;
+            std::uint64_t low = 0;
+            std::uint64_t high = 0;
+            // Selects rather than branches, the direction taken being unpredictable.
+            for(const node* n = root.get(); n != nullptr; depth++) {
+                it.ancestors[depth % const_iterator::window] = n;
+                bool right = Compare()(n->value, key);
+                (depth < 64 ? low : high) |= std::uint64_t(right) << depth % 64;
+                found = right ? found : n;
+                found_depth = right ? found_depth : depth;
+                const node* children[2] = {n->left, n->right};
+                n = children[right];
+            }
+            // Forgets the ancestors on the way below the element found.
+            unsigned lowest = depth > const_iterator::window ? depth - const_iterator::window : 0;
+            it.current = found;
+            it.turns[0] = low;
+            it.turns[1] = high;
+            it.depth = found_depth;
+            it.kept = found_depth > lowest ? found_depth - lowest : 0;
+            return it;
+        }
+
+        template<typename K>
+        const_iterator find(const K& key) const{
+            const_iterator it = lower_bound(key);
+            return it != end() && !Compare()(key, *it) ? it : end();
+        }
+
+        const_iterator begin() const noexcept{
+            const_iterator it(root.get());
+            it.current = root.get();
+            if(it.current != nullptr) {
+                while(it.current->left != nullptr) it.descend(false);
+            }
+            return it;
+        }
+
+        const_iterator end() const noexcept{
+            return const_iterator(root.get());
+        }
+
+        std::size_t size() const noexcept{
+            return count(root.get());
+        }
+
+        bool empty() const noexcept{
+            return root.get() == nullptr;
+        }
+
+        void swap(persistent_set& rhs) noexcept{
+            std::swap(root, rhs.root);
+        }
+    };
+
+}
+
+// Policies of FunctionMaxima. A policy decides how the points shared between copies
+// of a function count their references and which container keeps the points.
+// Custom policies derive from one of the ones below and replace some of the members.
+struct maxima_policy_base{
+    // Allocates the nodes of the containers and the shared storage of the points.
+    // It is default constructed wherever needed, so it has to be stateless.
+    template<typename T>
+    using allocator = std::allocator<T>;
+
+    template<typename T, typename Compare, typename Allocator>
+    using point_container = std::multiset<T, Compare, Allocator>;
+
+    static constexpr bool maxima_by_argument = false;
+    static constexpr bool range_max = false;
+    static constexpr bool track_minima = false;
+};
+
+// The default policy allows copies of a function to be handed over to other threads,
+// the single threaded one avoids atomic operations on every copy of a point.
+struct multi_threaded_t : maxima_policy_base{
+    using counter_type = std::atomic<std::size_t>;
+
+    static void increment(counter_type& counter) noexcept{
+        counter.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Returns true if the last reference has been dropped.
+    static bool decrement(counter_type& counter) noexcept{
+        return counter.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+};
+
+struct single_threaded_t : maxima_policy_base{
+    using counter_type = std::size_t;
+
+    static void increment(counter_type& counter) noexcept{
+        ++counter;
+    }
+
+    static bool decrement(counter_type& counter) noexcept{
+        return --counter == 0;
+    }
+};
+
+// Keeps the points in a B+ tree instead of a red-black tree. Neighbouring points
+// usually share a leaf, which makes the lookups done by set_value and erase cheaper,
+// but modifying the function invalidates its iterators, so set_values is not offered.
+template<typename Base = multi_threaded_t>
+struct btree_t : Base{
+    template<typename T, typename Compare, typename Allocator>
+    using point_container = function_maxima_detail::bplus_multiset<T, Compare, Allocator>;
+};
+
+// Also keeps the local maxima ordered by their arguments, which makes
+// FunctionMaxima::maxima_in available at the cost of a second set of maxima.
+template<typename Base = multi_threaded_t>
+struct maxima_by_argument_t : Base{
+    static constexpr bool maxima_by_argument = true;
+};
+
+// Kind of a change of the set of local maxima reported by FunctionMaxima::subscribe.
+enum class maxima_change{
+    added,
+    removed
+};
+
+// Also keeps track of the local minima, which FunctionMaxima::mn_begin and mn_end
+// iterate over. They are found together with the maxima, from the same neighbours.
+template<typename Base = multi_threaded_t>
+struct track_minima_t : Base{
+    static constexpr bool track_minima = true;
+};
+
+// Also keeps the points in a tree that knows the greatest value in every subtree,
+// which makes FunctionMaxima::max_in_range available at the cost of a second tree.
+template<typename Base = multi_threaded_t>
+struct range_max_t : Base{
+    static constexpr bool range_max = true;
+};
+
+template<typename A, typename V, typename Policy>
+class FunctionMaxima;
+
+template<typename A, typename V, typename Policy>
+class FlatFunctionMaxima;
+
+template<typename A, typename V, typename Policy>
+class DenseFunctionMaxima;
+
+template<typename A, typename V, typename Policy>
+class PersistentFunctionMaxima;
+
+
+// Point of a function, shared between copies of the function and its maxima.
+template<typename A, typename V, typename Policy,
+         bool Inline = function_maxima_detail::stores_inline<A, V>>
+class FunctionPoint{
+
+    // Argument and value are kept together with the reference counter, so that
+    // a point costs a single allocation and copies of it share one counter.
+    struct point_data{
+        A argument;
+        V val;
+        typename Policy::counter_type references;
+
+        template<typename Key, typename... Args>
+        point_data(Key&& a, Args&&... args):
+        argument(std::forward<Key>(a)), val(std::forward<Args>(args)...), references(1)
+        {}
+    };
+
+    using data_allocator = typename Policy::template allocator<point_data>;
+    using data_traits = std::allocator_traits<data_allocator>;
+
+    // Mutable only for replace.
+    mutable point_data* data;
+
+    template<typename... Args>
+    static point_data* make_data(Args&&... args){
+        data_allocator alloc;
+        point_data* p = data_traits::allocate(alloc, 1);
+        try {
+            return ::new (static_cast<void*>(p)) point_data(std::forward<Args>(args)...);
+        }
+        catch(...) {
+            data_traits::deallocate(alloc, p, 1);
+            throw;
+        }
+    }
+
+    // No-throw.
+    void release() const noexcept{
+        if(data != nullptr && Policy::decrement(data->references)) {
+            data_allocator alloc;
+            data->~point_data();
+            data_traits::deallocate(alloc, data, 1);
+        }
+    }
+
+private:
+
+    FunctionPoint(const A& a, const  V& v):
+    data(make_data(a, v))
+    {}
+
+    // Constructs the argument from a and the value from args.
+    template<typename Key, typename... Args>
+    FunctionPoint(std::in_place_t, Key&& a, Args&&... args):
+    data(make_data(std::forward<Key>(a), std::forward<Args>(args)...))
+    {}
+
+    // Makes a point kept in a std::multiset share the data of rhs, whose argument is
+    // equivalent, in place. Copies of the point keep the old data. No-throw.
+    void replace(const FunctionPoint& rhs) const noexcept{
+        if(data == rhs.data) return;
+        Policy::increment(rhs.data->references);
+        release();
+        data = rhs.data;
+    }
+
+    template<typename> friend struct function_maxima_detail::element_replacer;
+    template<typename, typename, typename> friend class FunctionMaxima;
+    template<typename, typename, typename> friend class FlatFunctionMaxima;
+    template<typename, typename, typename> friend class DenseFunctionMaxima;
+    template<typename, typename, typename> friend class PersistentFunctionMaxima;
+
+public:
+
+    A const& arg() const{
+        return data->argument;
+    }
+
+    V const& value() const{
+        return data->val;
+    }
+
+    FunctionPoint& operator=(const FunctionPoint &rhs) noexcept{
+        if(this == &rhs){
+            return *this;
+        }
+        Policy::increment(rhs.data->references);
+        release();
+        data = rhs.data;
+        return *this;
+    }
+
+    FunctionPoint& operator=(FunctionPoint &&rhs) noexcept{
+        if(this == &rhs){
+            return *this;
+        }
+        release();
+        data = rhs.data;
+        rhs.data = nullptr;
+        return *this;
+    }
+
+    FunctionPoint(const FunctionPoint& rhs) noexcept:
+    data(rhs.data)
+    {
+        Policy::increment(data->references);
+    }
+
+    FunctionPoint(FunctionPoint&& rhs) noexcept:
+    data(rhs.data)
+    {
+        rhs.data = nullptr;
+    }
+
+    ~FunctionPoint(){
+        release();
+    }
+
+};
+
+// Points of small trivially copyable types are kept by value, so that they live
+// directly in the nodes of the function and copying them never allocates.
+template<typename A, typename V, typename Policy>
+class FunctionPoint<A, V, Policy, true>{
+
+    // Mutable only for replace.
+    mutable A argument;
+    mutable V val;
+
+private:
+
+    FunctionPoint(const A& a, const  V& v):
+    argument(a),
+    val(v)
+    {}
+
+    template<typename Key, typename... Args>
+    FunctionPoint(std::in_place_t, Key&& a, Args&&... args):
+    argument(std::forward<Key>(a)),
+    val(std::forward<Args>(args)...)
+    {}
+
+    // See the general FunctionPoint::replace.
+    void replace(const FunctionPoint& rhs) const noexcept{
+        argument = rhs.argument;
+        val = rhs.val;
+    }
+
+    template<typename> friend struct function_maxima_detail::element_replacer;
+    template<typename, typename, typename> friend class FunctionMaxima;
+    template<typename, typename, typename> friend class FlatFunctionMaxima;
+    template<typename, typename, typename> friend class DenseFunctionMaxima;
+    template<typename, typename, typename> friend class PersistentFunctionMaxima;
+
+public:
+
+    A const& arg() const{
+        return argument;
+    }
+
+    V const& value() const{
+        return val;
+    }
+
+};
+
+template<typename A, typename V, typename Policy = multi_threaded_t>
 class FunctionMaxima{
 
 public:
 
-    class point_type{
+    using point_type = FunctionPoint<A, V, Policy>;
+
+
+private:
+
+    using compare_points = function_maxima_detail::compare_points<A, point_type>;
+    using compare_maxima = function_maxima_detail::compare_maxima<point_type>;
+    using compare_minima = function_maxima_detail::compare_minima<point_type>;
+
+
+public:
+    using allocator_type = typename Policy::template allocator<point_type>;
+
+    using point_set = typename Policy::template point_container<point_type, compare_points, allocator_type>;
+    using iterator = typename point_set::const_iterator;
+
+    using maxima_set = typename std::conditional<Policy::maxima_by_argument,
+        function_maxima_detail::indexed_maxima<A, point_type, compare_maxima, allocator_type>,
+        std::set<point_type, compare_maxima, allocator_type>>::type;
+    using mx_iterator = typename maxima_set::const_iterator;
+    using mx_view = function_maxima_detail::maxima_view<mx_iterator>;
+
+    using minima_set = std::set<point_type, compare_minima, allocator_type>;
+    using mn_iterator = typename minima_set::const_iterator;
+
+    // Receives the changes of the set of maxima, see subscribe.
+    using change_sink = std::function<void(maxima_change, const point_type&)>;
+
+private:
+
+    // Position of a point in the set of maxima, as returned by find and insert.
+    using mx_position = typename maxima_set::iterator;
+
+    using range_index = typename std::conditional<Policy::range_max,
+        function_maxima_detail::range_max_index<A, point_type, allocator_type>,
+        function_maxima_detail::no_range_index<A, point_type>>::type;
+
+    point_set points;
+    maxima_set maxima;
+    // Answers max_in_range, if the policy asks for it. Modifications of the function
+    // stage their changes in it and commit them together with the rest.
+    range_index ranges;
+    // Local minima, kept only if the policy asks for them.
+    minima_set minima;
+    // Subscriber to the changes of the set of maxima, if any.
+    change_sink sink;
+
+    using change_event = std::pair<maxima_change, point_type>;
+
+    // Sizes of buffers that are necessary for strong exception guarantee and
+    // performing rollbacks of function operations.
+    static const int NUMBER_TO_ERASE  = 5;
+    static const int NUMBER_TO_ROLLBACK = 4;
+
+    // Buffer necessary for strong exception guarantee in operations.
+    mx_position to_erase[NUMBER_TO_ERASE];
+    // Buffer necessary for performing rollbacks of function operations and.
+    mx_position to_rollback[NUMBER_TO_ROLLBACK];
+    bool if_erase[NUMBER_TO_ERASE];
+    bool if_rollback[NUMBER_TO_ROLLBACK];
+    // The same buffers for the set of minima.
+    mn_iterator mn_to_erase[NUMBER_TO_ERASE];
+    mn_iterator mn_to_rollback[NUMBER_TO_ROLLBACK];
+    bool mn_if_erase[NUMBER_TO_ERASE];
+    bool mn_if_rollback[NUMBER_TO_ROLLBACK];
+
+    // Inverse of a change made within a transaction: the point to put back, or the
+    // point added by the transaction, to be erased.
+    struct undo_entry{
+        point_type point;
+        bool restore;
+    };
+
+    // Log of the open transaction, see begin_transaction.
+    std::vector<undo_entry> undo_log;
+    bool transaction_open;
+
+    // Drops the entries logged for an operation that has failed. No-throw.
+    void truncate_log(size_t mark) noexcept{
+        while(undo_log.size() > mark) {
+            undo_log.pop_back();
+        }
+    }
+
+    // Resets the buffers to their default states.
+    void clear_erase() {
+        for(int i = 0; i < NUMBER_TO_ERASE; i++) {
+            if_erase[i] = false;
+            mn_if_erase[i] = false;
+        }
+    }
+
+    void clear_rollback() {
+        for(int i = 0; i < NUMBER_TO_ROLLBACK; i++) {
+            if_rollback[i] = false;
+            mn_if_rollback[i] = false;
+        }
+    }
+
+    // Rolling back the additions to the sets of maxima and minima.
+    void rollback_maxima() {
+        for(int i = 0; i < NUMBER_TO_ROLLBACK; i++) {
+            if(if_rollback[i]) {
+                maxima.erase(to_rollback[i]);
+            }
+            if(mn_if_rollback[i]) {
+                minima.erase(mn_to_rollback[i]);
+            }
+        }
+    }
+
+    // No-throw.
+    void erase_from_maxima() {
+        for(int i = 0; i < NUMBER_TO_ERASE; i++) {
+            if(if_erase[i]) {
+                maxima.erase(to_erase[i]);
+            }
+            if(mn_if_erase[i]) {
+                minima.erase(mn_to_erase[i]);
+            }
+        }
+    }
+
+    // Gathers the changes of the set of maxima recorded in the buffers, removals first.
+    // Strong Guarantee.
+    void collect_changes(std::vector<change_event>& events) const{
+        for(int i = 0; i < NUMBER_TO_ERASE; i++) {
+            if(if_erase[i]) events.emplace_back(maxima_change::removed, *to_erase[i]);
+        }
+        for(int i = 0; i < NUMBER_TO_ROLLBACK; i++) {
+            if(if_rollback[i]) events.emplace_back(maxima_change::added, *to_rollback[i]);
+        }
+    }
+
+    // Reports the changes of an operation that has already been committed.
+    void notify(const std::vector<change_event>& events) const{
+        for(const change_event& event : events) {
+            sink(event.first, event.second);
+        }
+    }
+
+    // In some of the functions below, to_be_erased is the iterator to a point_type that
+    // is to be erased, either as a result of calling the 'erase' function or due to being
+    // overwritten by a new value for its argument.
+
+    // Returns the iterator to the point preceding p, skipping to_be_erased if necessary.
+    iterator multi_prev(const iterator p, const iterator to_be_erased) const{
+        return std::prev(p) == to_be_erased ? std::prev(std::prev(p)) : std::prev(p);
+    }
+
+    iterator multi_next(const iterator p, const iterator previous) const{
+        if(p == points.end() || std::next(p) == points.end()) return points.end();
+        return std::next(p) == previous ? std::next(std::next(p)) : std::next(p);
+    }
+
+    // Checks if p points to the first point of the function (or will point after
+    // to_be erased is erased).
+    bool multi_is_beginning(const iterator p, const iterator previous) const{
+        if(p == points.begin()) return true;
+        else if(std::prev(p) == previous && std::prev(p) == points.begin()) return true;
+        return false;
+    }
+
+    bool multi_is_ending(const iterator p, const iterator previous) const{
+        if(p == --points.end()) return true;
+        else if(std::next(p) == previous && std::next(p) == --points.end()) return true;
+        return false;
+    }
+
+    // Values of the neighbours of p, skipping previous, nullptr if there is none.
+    void neighbour_values(const iterator p, const iterator previous, const V*& left, const V*& right) const{
+        left = multi_is_beginning(p, previous) ? nullptr : &multi_prev(p, previous)->value();
+        right = multi_is_ending(p, previous) ? nullptr : &multi_next(p, previous)->value();
+    }
+
+    // This function has Strong Guarantee.
+    bool is_maximum(const iterator p, const iterator previous) const {
+        const V* left;
+        const V* right;
+        neighbour_values(p, previous, left, right);
+        return function_maxima_detail::is_local_maximum(left, p->value(), right);
+    }
+
+    // This function has Strong Guarantee.
+    bool present_in_maxima_set(const point_type& p){
+        return maxima.find(p) != maxima.end();
+    }
+
+    // Checks if 'it' points to a point that is a local maximum, and adds/removes
+    // it from the set of maxima accordingly. Strong Guarantee.
+    void conditional_add_new_maximum(const iterator it, int i, const iterator previous) {
+        if(it == points.end() || it == previous) return;
+        const V* left;
+        const V* right;
+        neighbour_values(it, previous, left, right);
+        if constexpr (Policy::track_minima) {
+            update_minimum(*it, i, function_maxima_detail::is_local_minimum(left, it->value(), right));
+        }
+        bool is_max = function_maxima_detail::is_local_maximum(left, it->value(), right);
+        if (is_max) {
+            if (!present_in_maxima_set(*it)) {
+                to_rollback[i] = maxima.insert(*it).first;
+                if_rollback[i] = true;
+            }
+        }
+        else {
+            if (present_in_maxima_set(*it)) {
+                to_erase[i] = maxima.find(*it);
+                if_erase[i] = true;
+            }
+        }
+    }
+
+    // Adds or removes the point p from the set of minima, using position i of the
+    // buffers. Strong Guarantee.
+    void update_minimum(const point_type& p, int i, bool is_min){
+        mn_iterator found = minima.find(p);
+        if(is_min && found == minima.end()) {
+            mn_to_rollback[i] = minima.insert(p).first;
+            mn_if_rollback[i] = true;
+        }
+        else if(!is_min && found != minima.end()) {
+            mn_to_erase[i] = found;
+            mn_if_erase[i] = true;
+        }
+    }
+
+    // Adds or removes the point p from the set of maxima, given the values of its
+    // neighbours after the operation, using position i of the buffers. Strong Guarantee.
+    void update_status(const point_type& p, int i, const V* left, const V* right){
+        if constexpr (Policy::track_minima) {
+            update_minimum(p, i, function_maxima_detail::is_local_minimum(left, p.value(), right));
+        }
+        bool is_max = function_maxima_detail::is_local_maximum(left, p.value(), right);
+        mx_position found = maxima.find(p);
+        if(is_max && found == maxima.end()) {
+            to_rollback[i] = maxima.insert(p).first;
+            if_rollback[i] = true;
+        }
+        else if(!is_max && found != maxima.end()) {
+            to_erase[i] = found;
+            if_erase[i] = true;
+        }
+    }
+
+    // Sets the point p, gathering the changes of the set of maxima into events if
+    // there is a sink. The operations below do not call the sink themselves, so that
+    // the public ones can log the changes of a transaction before it is called.
+    // This function has Strong Guarantee.
+    void custom_insert(const point_type& p, std::vector<change_event>& events){
+        iterator previous = find_argument(p.arg());
+        if(previous != points.end() && function_maxima_detail::equivalent(p.value(), (*previous).value())) return;
+        custom_insert(previous, points.end(), p, events);
+    }
+
+    // Same as above, given the point previous with the argument of p, whose value is
+    // not equivalent to the one of p, or points.end() if there is none. A new point is
+    // inserted as close as possible before hint. Returns the position of p.
+    iterator custom_insert(iterator previous, iterator hint, const point_type& p, std::vector<change_event>& events){
+
+        if(previous != points.end()) {
+            overwrite(previous, p, events);
+            return previous;
+        }
+        iterator it = points.insert(hint, p);
+        // Inserting may invalidate the iterators of some containers.
+        previous = points.end();
+
+        try {
+
+            ranges.set(*it);
+            conditional_add_new_maximum(it,1, previous);
+            conditional_add_new_maximum(multi_next(it, previous), 2, previous);
+            if(!multi_is_beginning(it, previous)) {
+                conditional_add_new_maximum(multi_prev(it, previous), 3, previous);
+            }
+            if(sink) collect_changes(events);
+
+        }
+        catch(...) {
+
+            points.erase(it);
+            ranges.rollback();
+            rollback_maxima();
+            clear_rollback();
+            clear_erase();
+            throw;
+
+        }
+
+        erase_from_maxima();
+        ranges.commit();
+        clear_rollback();
+        clear_erase();
+        return it;
+    }
+
+    // Position of the point with argument a, or points.end() if there is none. Takes
+    // constant time when a is greater than all the arguments, as when appending.
+    iterator find_argument(const A& a) const{
+        if(points.empty() || !((*std::prev(points.end())).arg() < a)) return points.find(a);
+        return points.end();
+    }
+
+    // Same as find_argument, looking next to hint first, see set_value_hint. Leaves in
+    // hint a position to insert a point with argument a before.
+    iterator find_argument(iterator& hint, const A& a) const{
+        if(hint == points.end() || a < (*hint).arg()) {
+            if(hint == points.begin()) return points.end();
+            iterator before = std::prev(hint);
+            if((*before).arg() < a) return points.end();
+            if(!(a < (*before).arg())) return before;
+        }
+        else if(!((*hint).arg() < a)) {
+            return hint;
+        }
+        hint = points.end();
+        return find_argument(a);
+    }
+
+    // Replaces the point at previous with p, which has the same argument, in the node
+    // of the tree that holds it, see element_replacer: the neighbours are evaluated with
+    // the new value first, and the point itself is only swapped when nothing can throw
+    // any more. previous stays valid. This function has Strong Guarantee.
+    void overwrite(const iterator previous, const point_type& p, std::vector<change_event>& events){
+        iterator left = previous == points.begin() ? points.end() : std::prev(previous);
+        iterator right = std::next(previous);
+        const V* left_value = left == points.end() ? nullptr : &(*left).value();
+        const V* right_value = right == points.end() ? nullptr : &(*right).value();
+
+        try {
+
+            ranges.set(p);
+            update_status(p, 1, left_value, right_value);
+            if(right != points.end()) {
+                iterator following = std::next(right);
+                update_status(*right, 2, &p.value(), following == points.end() ? nullptr : &(*following).value());
+            }
+            if(left != points.end()) {
+                update_status(*left, 3, left == points.begin() ? nullptr : &(*std::prev(left)).value(), &p.value());
+            }
+            auto temp = maxima.find(*previous);
+            if(temp != maxima.end()) {
+                to_erase[4] = temp;
+                if_erase[4] = true;
+            }
+            if constexpr (Policy::track_minima) {
+                auto min_temp = minima.find(*previous);
+                if(min_temp != minima.end()) {
+                    mn_to_erase[4] = min_temp;
+                    mn_if_erase[4] = true;
+                }
+            }
+            if(sink) collect_changes(events);
+
+        }
+        catch(...) {
+
+            ranges.rollback();
+            rollback_maxima();
+            clear_rollback();
+            clear_erase();
+            throw;
+
+        }
+
+        function_maxima_detail::element_replacer<point_set>::replace(points, previous, p);
+        erase_from_maxima();
+        ranges.commit();
+        clear_rollback();
+        clear_erase();
+    }
+
+    // Applies a batch of updates sorted by arguments. Each point is looked for by
+    // walking on from the previous one, as batches are often dense, and overwritten
+    // in place or inserted. Then every point whose neighbourhood has changed is
+    // evaluated once. The overwritten points are kept until all that succeeds, so that
+    // they can be put back. Strong Guarantee.
+    void batch_insert(const std::vector<point_type>& updates, std::vector<change_event>& events){
+        using replacer = function_maxima_detail::element_replacer<point_set>;
+        // Walking further than that costs more than searching the tree.
+        constexpr int max_walk = 4;
+
+        std::vector<iterator> touched;
+        std::vector<iterator> inserted;
+        std::vector<std::pair<iterator, point_type>> replaced;
+        std::vector<mx_position> added;
+        std::vector<mx_position> removed;
+        std::vector<mn_iterator> minima_added;
+        std::vector<mn_iterator> minima_removed;
+
+        try {
+            touched.reserve(updates.size());
+            inserted.reserve(updates.size());
+            replaced.reserve(updates.size());
+            iterator position = points.begin();
+            for(const point_type& p : updates) {
+                int walked = 0;
+                while(position != points.end() && (*position).arg() < p.arg() && walked < max_walk) {
+                    ++position;
+                    walked++;
+                }
+                if(position != points.end() && (*position).arg() < p.arg()) {
+                    position = points.lower_bound(p.arg());
+                }
+                if(position == points.end() || p.arg() < (*position).arg()) {
+                    iterator it = points.insert(position, p);
+                    inserted.push_back(it);
+                    touched.push_back(it);
+                }
+                else if(!function_maxima_detail::equivalent(p.value(), (*position).value())) {
+                    replaced.emplace_back(position, *position);
+                    replacer::replace(points, position, p);
+                    touched.push_back(position);
+                }
+            }
+            for(iterator it : touched) {
+                ranges.set(*it);
+            }
+
+            // Neighbourhoods are visited in the order of arguments, so a point shared by
+            // two of them can only repeat one of the last two candidates.
+            std::vector<iterator> candidates;
+            candidates.reserve(3 * touched.size());
+            auto add_candidate = [&](iterator it){
+                size_type n = candidates.size();
+                if(it == points.end() || (n > 0 && candidates[n - 1] == it) ||
+                   (n > 1 && candidates[n - 2] == it)) return;
+                candidates.push_back(it);
+            };
+            for(iterator it : touched) {
+                if(it != points.begin()) add_candidate(std::prev(it));
+                add_candidate(it);
+                add_candidate(std::next(it));
+            }
+
+            // The changes are recorded after the sets are modified, so there must be
+            // room for all of them before.
+            added.reserve(candidates.size());
+            removed.reserve(candidates.size() + replaced.size());
+            minima_added.reserve(candidates.size());
+            minima_removed.reserve(candidates.size() + replaced.size());
+            for(iterator it : candidates) {
+                iterator right = std::next(it);
+                const V* left_value = it == points.begin() ? nullptr : &(*std::prev(it)).value();
+                const V* right_value = right == points.end() ? nullptr : &(*right).value();
+                if constexpr (Policy::track_minima) {
+                    bool is_min = function_maxima_detail::is_local_minimum(left_value, (*it).value(), right_value);
+                    mn_iterator present = minima.find(*it);
+                    if(is_min && present == minima.end()) {
+                        minima_added.push_back(minima.insert(*it).first);
+                    }
+                    else if(!is_min && present != minima.end()) {
+                        minima_removed.push_back(present);
+                    }
+                }
+                bool is_max = function_maxima_detail::is_local_maximum(left_value, (*it).value(), right_value);
+                if(is_max) {
+                    auto result = maxima.insert(*it);
+                    if(result.second) added.push_back(result.first);
+                }
+                else {
+                    mx_position present = maxima.find(*it);
+                    if(present != maxima.end()) removed.push_back(present);
+                }
+            }
+            // The sets still hold the overwritten points with their old values.
+            for(const auto& r : replaced) {
+                mx_position present = maxima.find(r.second);
+                if(present != maxima.end()) removed.push_back(present);
+                if constexpr (Policy::track_minima) {
+                    mn_iterator min_present = minima.find(r.second);
+                    if(min_present != minima.end()) minima_removed.push_back(min_present);
+                }
+            }
+            if(sink) {
+                events.reserve(removed.size() + added.size());
+                for(mx_position it : removed) {
+                    events.emplace_back(maxima_change::removed, *it);
+                }
+                for(mx_position it : added) {
+                    events.emplace_back(maxima_change::added, *it);
+                }
+            }
+        }
+        catch(...) {
+            ranges.rollback();
+            for(mx_position it : added) {
+                maxima.erase(it);
+            }
+            for(mn_iterator it : minima_added) {
+                minima.erase(it);
+            }
+            for(const auto& r : replaced) {
+                replacer::replace(points, r.first, r.second);
+            }
+            for(iterator it : inserted) {
+                points.erase(it);
+            }
+            throw;
+        }
+
+        for(mx_position it : removed) {
+            maxima.erase(it);
+        }
+        for(mn_iterator it : minima_removed) {
+            minima.erase(it);
+        }
+        ranges.commit();
+    }
+
+    // This function has Strong Guarantee.
+    void custom_erase(A const& a, std::vector<change_event>& events){
+        auto it = points.find(a);
+
+        if(it != points.end()) {
+            auto p = *it;
+
+            auto it2 = maxima.find(p);
+            try {
+                ranges.erase(a);
+                if (it2 != maxima.end()) {
+                    to_erase[0] = it2;
+                    if_erase[0] = true;
+                }
+                if constexpr (Policy::track_minima) {
+                    auto min_it = minima.find(p);
+                    if(min_it != minima.end()) {
+                        mn_to_erase[0] = min_it;
+                        mn_if_erase[0] = true;
+                    }
+                }
+                conditional_add_new_maximum(std::next(it), 2, it);
+                if(it != points.begin()) conditional_add_new_maximum(std::prev(it), 3, it);
+                if(sink) collect_changes(events);
+
+            } catch (...) {
+                ranges.rollback();
+                rollback_maxima();
+
+                clear_rollback();
+                clear_erase();
+                throw;
+            }
+
+            erase_from_maxima();
+            ranges.commit();
+            points.erase(it);
+            clear_rollback();
+            clear_erase();
+        }
+    }
+
+    // See erase_range. This function has Strong Guarantee.
+    void custom_erase_range(A const& lo, A const& hi, std::vector<change_event>& events){
+        if(!(lo < hi)) return;
+        iterator first = points.lower_bound(lo);
+        iterator last = points.lower_bound(hi);
+        if(first == last) return;
+
+        iterator left = first == points.begin() ? points.end() : std::prev(first);
+        iterator right = last;
+        std::vector<mx_position> removed;
+        std::vector<mn_iterator> minima_removed;
+        try {
+            ranges.erase_range(lo, hi);
+            const V* before = left == points.end() ? nullptr : &left->value();
+            for(iterator it = first; it != last; ++it) {
+                iterator following = std::next(it);
+                const V* after = following == points.end() ? nullptr : &following->value();
+                if(function_maxima_detail::is_local_maximum(before, it->value(), after)) {
+                    removed.push_back(maxima.find(*it));
+                }
+                if constexpr (Policy::track_minima) {
+                    if(function_maxima_detail::is_local_minimum(before, it->value(), after)) {
+                        minima_removed.push_back(minima.find(*it));
+                    }
+                }
+                before = &it->value();
+            }
+
+            const V* left_value = left == points.end() ? nullptr : &left->value();
+            const V* right_value = right == points.end() ? nullptr : &right->value();
+            if(left != points.end()) {
+                update_status(*left, 0, left == points.begin() ? nullptr : &std::prev(left)->value(),
+                              right_value);
+            }
+            if(right != points.end()) {
+                iterator following = std::next(right);
+                update_status(*right, 1, left_value,
+                              following == points.end() ? nullptr : &following->value());
+            }
+            if(sink) {
+                for(mx_position it : removed) {
+                    events.emplace_back(maxima_change::removed, *it);
+                }
+                collect_changes(events);
+            }
+        }
+        catch(...) {
+            ranges.rollback();
+            rollback_maxima();
+
+            clear_rollback();
+            clear_erase();
+            throw;
+        }
+
+        for(mx_position it : removed) {
+            maxima.erase(it);
+        }
+        for(mn_iterator it : minima_removed) {
+            minima.erase(it);
+        }
+        erase_from_maxima();
+        ranges.commit();
+        points.erase(first, last);
+        clear_rollback();
+        clear_erase();
+    }
+
+    // Replaces the function with new_points, whose local maxima and minima are given
+    // in their orders, for assign. This function has Strong Guarantee.
+    void replace_points(point_set& new_points, const std::vector<point_type>& sorted_maxima,
+                        const std::vector<point_type>& sorted_minima){
+        maxima_set new_maxima;
+        for(const point_type& p : sorted_maxima) {
+            new_maxima.insert(new_maxima.end(), p);
+        }
+        minima_set new_minima;
+        for(const point_type& p : sorted_minima) {
+            new_minima.insert(new_minima.end(), p);
+        }
+        range_index new_ranges;
+        new_ranges.assign_sorted(new_points.begin(), new_points.end());
+        new_ranges.commit();
+        std::vector<change_event> events;
+        if(sink) {
+            events.reserve(maxima.size() + new_maxima.size());
+            for(const point_type& p : maxima) {
+                events.emplace_back(maxima_change::removed, p);
+            }
+            for(const point_type& p : new_maxima) {
+                events.emplace_back(maxima_change::added, p);
+            }
+        }
+        if(transaction_open) {
+            // Rollback erases the new points before it puts the old ones back.
+            function_maxima_detail::reserve_more(undo_log, points.size() + new_points.size());
+            for(const point_type& p : points) {
+                undo_log.push_back(undo_entry{p, true});
+            }
+            for(const point_type& p : new_points) {
+                undo_log.push_back(undo_entry{p, false});
+            }
+        }
+
+        std::swap(points, new_points);
+        std::swap(maxima, new_maxima);
+        std::swap(minima, new_minima);
+        ranges.swap(new_ranges);
+        if(sink) notify(events);
+    }
+
+    // Sets the point p, given previous and hint as in custom_insert, for set_value,
+    // emplace_value and set_value_hint. This function has Strong Guarantee.
+    iterator set_point(iterator previous, iterator hint, const point_type& p){
+        std::vector<change_event> events;
+        size_t mark = undo_log.size();
+        bool added = false;
+        iterator result;
+        try {
+            if(transaction_open) {
+                function_maxima_detail::reserve_more(undo_log, 1);
+                if(previous != points.end()) undo_log.push_back(undo_entry{*previous, true});
+                else added = true;
+            }
+            result = custom_insert(previous, hint, p, events);
+        }
+        catch(...) {
+            truncate_log(mark);
+            throw;
+        }
+        if(added) undo_log.push_back(undo_entry{p, false});
+        if(sink) notify(events);
+        return result;
+    }
+
+public:
+
+    using size_type = size_t;
+
+    // Overwriting the value of an argument already present reuses the node holding
+    // it, without allocating or rebalancing the tree of points. If the argument
+    // already has an equivalent value, nothing is constructed. An argument greater
+    // than all the others is appended without a search, in amortised constant time
+    // apart from the updates of the maxima.
+    // This function has Strong Guarantee.
+    void set_value(A const& a, V const& v){
+        iterator previous = find_argument(a);
+        if(previous != points.end() && function_maxima_detail::equivalent(v, (*previous).value())) return;
+        set_point(previous, points.end(), point_type(a, v));
+    }
+
+    // Same as above, but the argument and the value are moved into the point.
+    void set_value(A&& a, V&& v){
+        iterator previous = find_argument(a);
+        if(previous != points.end() && function_maxima_detail::equivalent(v, (*previous).value())) return;
+        set_point(previous, points.end(), point_type(std::in_place, std::move(a), std::move(v)));
+    }
+
+    // Same as set_value, given hint: the point with argument a, or the point that
+    // is to follow it (end() if a is to be the greatest argument). With such a hint
+    // the point is found or inserted in amortised constant time apart from the
+    // updates of the maxima, with any other hint it is searched for as usual.
+    // Returns the position of the point with argument a. Strong Guarantee.
+    iterator set_value_hint(iterator hint, A const& a, V const& v){
+        iterator previous = find_argument(hint, a);
+        if(previous != points.end() && function_maxima_detail::equivalent(v, (*previous).value())) return previous;
+        return set_point(previous, hint, point_type(a, v));
+    }
+
+    // Sets the value for the argument constructed from a, constructing the value from
+    // args in place, in the storage of the point. The function is searched first: a
+    // point for a new argument is constructed at once, for a present one the value is
+    // constructed on its own to be compared and then moved into the point, which is
+    // not constructed at all if the values are equivalent. Strong Guarantee.
+    template<typename Key, typename... Args>
+    void emplace_value(Key&& a, Args&&... args){
+        if constexpr (!std::is_same<typename std::decay<Key>::type, A>::value) {
+            emplace_value(A(std::forward<Key>(a)), std::forward<Args>(args)...);
+        }
+        else {
+            iterator previous = find_argument(a);
+            if(previous == points.end()) {
+                set_point(previous, points.end(),
+                          point_type(std::in_place, std::forward<Key>(a), std::forward<Args>(args)...));
+                return;
+            }
+            V v(std::forward<Args>(args)...);
+            if(function_maxima_detail::equivalent(v, (*previous).value())) return;
+            set_point(previous, points.end(), point_type(std::in_place, std::forward<Key>(a), std::move(v)));
+        }
+    }
+
+    iterator begin() const noexcept{
+        return points.begin();
+    }
+
+    iterator end() const noexcept{
+        return points.end();
+    }
+
+    iterator find(A const& a) const{
+        return points.find(a);
+    }
+
+    mx_iterator mx_begin() const noexcept{
+        return maxima.begin();
+    }
+
+    mx_iterator mx_end() const noexcept{
+        return maxima.end();
+    }
+
+    // Registers a sink receiving every change of the set of maxima made by set_value,
+    // set_values, erase, erase_range and assign, replacing the previous one. A point
+    // overwritten by set_value is reported as removed if it was a maximum. The sink
+    // is called only after the operation has committed, removals first. Exceptions
+    // thrown by the sink are passed on, the function stays modified. The sink is
+    // neither copied nor swapped with the function.
+    void subscribe(change_sink new_sink){
+        sink = std::move(new_sink);
+    }
+
+    void unsubscribe() noexcept{
+        sink = nullptr;
+    }
+
+    // Starts logging the inverses of the changes made by set_value, set_values, erase,
+    // erase_range and assign, so that rollback can revert all of them in time
+    // proportional to the changes instead of keeping a copy of the function. Entries
+    // of the log share the points they put back. Has no effect if a transaction is
+    // already open. A transaction is not copied with the function, swap exchanges it
+    // along with the points, and assigning to the function is logged as assign is.
+    // No-throw.
+    void begin_transaction() noexcept{
+        transaction_open = true;
+    }
+
+    // Keeps the changes made within the transaction and ends it. No-throw.
+    void commit() noexcept{
+        undo_log.clear();
+        transaction_open = false;
+    }
+
+    // Reverts the changes made within the transaction, latest first, and ends it. The
+    // sink is notified of the changes of the maxima made by reverting. Every change is
+    // reverted with Strong Guarantee: if one of them throws, the ones reverted so far
+    // stay reverted and the transaction stays open, so rollback may be called again.
+    void rollback(){
+        while(!undo_log.empty()) {
+            const undo_entry& entry = undo_log.back();
+            std::vector<change_event> events;
+            if(entry.restore) custom_insert(entry.point, events);
+            else custom_erase(entry.point.arg(), events);
+            undo_log.pop_back();
+            if(sink) notify(events);
+        }
+        transaction_open = false;
+    }
+
+    bool in_transaction() const noexcept{
+        return transaction_open;
+    }
+
+    // Local minima in the order of increasing values, points with equal values by
+    // their arguments. Empty unless the policy is built with track_minima_t.
+    mn_iterator mn_begin() const noexcept{
+        return minima.begin();
+    }
+
+    mn_iterator mn_end() const noexcept{
+        return minima.end();
+    }
+
+    // The global maximum of the function: of the points with the greatest value,
+    // the one with the least argument. It is always a local maximum, so it is the
+    // first one in the order of mx_begin. Takes O(1) time.
+    // Throws InvalidArg if the function is empty. Strong Guarantee.
+    point_type const& global_max() const{
+        if(maxima.empty()) {
+            throw InvalidArg();
+        }
+        return *maxima.begin();
+    }
+
+    // Same as global_max.
+    point_type const& top() const{
+        return global_max();
+    }
+
+    // The k greatest local maxima, in the order of mx_begin, or all of them if there
+    // are fewer. Takes O(k) time. No-throw.
+    mx_view top_k(size_type k) const noexcept{
+        return function_maxima_detail::first_k(maxima.begin(), maxima.end(), k);
+    }
+
+    // The point with the greatest value among the ones with arguments in [lo, hi],
+    // the one with the least argument on ties. Takes O(log n) expected time.
+    // Available with policies built with range_max_t. Throws InvalidArg if there is
+    // no point in the range. This function has Strong Guarantee.
+    point_type max_in_range(A const& lo, A const& hi) const{
+        static_assert(Policy::range_max, "max_in_range requires range_max_t");
+        const point_type* best = ranges.max_in(lo, hi);
+        if(best == nullptr) {
+            throw InvalidArg();
+        }
+        return *best;
+    }
+
+    // Local maxima with arguments in [lo, hi], in the order of arguments. Takes
+    // O(log n + k) time for k maxima in the range. Available with policies built
+    // with maxima_by_argument_t. This function has Strong Guarantee.
+    auto maxima_in(A const& lo, A const& hi) const{
+        static_assert(Policy::maxima_by_argument, "maxima_in requires maxima_by_argument_t");
+        return maxima.in_range(lo, hi);
+    }
+
+    // This function has Strong Guarantee.
+    void erase(A const& a){
+        std::vector<change_event> events;
+        size_t mark = undo_log.size();
+        try {
+            if(transaction_open) {
+                iterator it = points.find(a);
+                if(it == points.end()) return;
+                undo_log.push_back(undo_entry{*it, true});
+            }
+            custom_erase(a, events);
+        }
+        catch(...) {
+            truncate_log(mark);
+            throw;
+        }
+        if(sink) notify(events);
+    }
+
+    // Erases all the points with arguments in [lo, hi). The run of points is spliced
+    // out in one pass: only the points of the run that are local maxima are looked up
+    // in the set of maxima, and only the two points around the run are re-evaluated.
+    // This function has Strong Guarantee.
+    void erase_range(A const& lo, A const& hi){
+        std::vector<change_event> events;
+        size_t mark = undo_log.size();
+        try {
+            if(transaction_open && lo < hi) {
+                iterator last = points.lower_bound(hi);
+                for(iterator it = points.lower_bound(lo); it != last; ++it) {
+                    undo_log.push_back(undo_entry{*it, true});
+                }
+            }
+            custom_erase_range(lo, hi, events);
+        }
+        catch(...) {
+            truncate_log(mark);
+            throw;
+        }
+        if(sink) notify(events);
+    }
+
+    // Sets the values of a whole batch of (argument, value) pairs, as if set_value
+    // was called for each of them in turn. The points are found walking through the
+    // function in the order of arguments, and every point whose status may change is
+    // evaluated once for the whole batch instead of once per pair. The batch keeps
+    // iterators to the points across insertions, so it is not available with btree_t.
+    // This function has Strong Guarantee for the whole batch.
+    template<typename Iterator>
+    void set_values(Iterator first, Iterator last){
+        static_assert(function_maxima_detail::has_stable_iterators<point_set>::value,
+                      "set_values requires a container with stable iterators");
+        std::vector<point_type> updates = function_maxima_detail::sorted_updates<point_type>(
+            first, last, [](A const& a, V const& v){
+                return point_type(a, v);
+            });
+        if(updates.empty()) return;
+
+        std::vector<change_event> events;
+        size_t mark = undo_log.size();
+        std::vector<bool> added;
+        try {
+            if(transaction_open) {
+                function_maxima_detail::reserve_more(undo_log, updates.size());
+                added.reserve(updates.size());
+                for(const point_type& p : updates) {
+                    iterator previous = points.find(p.arg());
+                    added.push_back(previous == points.end());
+                    if(previous != points.end()) undo_log.push_back(undo_entry{*previous, true});
+                }
+            }
+            batch_insert(updates, events);
+        }
+        catch(...) {
+            truncate_log(mark);
+            throw;
+        }
+        for(size_t i = 0; i < added.size(); i++) {
+            if(added[i]) undo_log.push_back(undo_entry{updates[i], false});
+        }
+        if(sink) notify(events);
+    }
+
+    // Replaces the function with the one given by a range of (argument, value) pairs
+    // sorted by arguments. Of several pairs with equal arguments the last one wins,
+    // as with consecutive calls to set_value. Throws InvalidArg if the range is not
+    // sorted. Points are appended at the end of the tree and the maxima are found in
+    // a single sweep, so apart from sorting the maxima it takes O(n) time. Values with
+    // a vector kernel are swept in an array, see function_maxima_detail::extrema_mask.
+    // This function has Strong Guarantee.
+    template<typename Iterator>
+    void assign(Iterator first, Iterator last){
+        if constexpr (function_maxima_detail::has_extrema_kernel<V>) {
+            assign(first, last, 1);
+            return;
+        }
+        point_set new_points;
+        function_maxima_detail::append_sorted(new_points, first, last, [](A const& a, V const& v){
+            return point_type(a, v);
+        });
+        std::vector<point_type> new_minima;
+        if constexpr (Policy::track_minima) {
+            new_minima = function_maxima_detail::sorted_minima<point_type>(new_points.begin(), new_points.end());
+        }
+        replace_points(new_points,
+                       function_maxima_detail::sorted_maxima<point_type>(new_points.begin(), new_points.end()),
+                       new_minima);
+    }
+
+    // Same as assign, but the local maxima (and minima) are found and sorted by the
+    // given number of threads, see function_maxima_detail::parallel_sorted_extrema.
+    // The points are gathered in an array first. This function has Strong Guarantee.
+    template<typename Iterator>
+    void assign(Iterator first, Iterator last, size_type threads){
+        std::vector<point_type> sorted;
+        function_maxima_detail::append_sorted(sorted, first, last, [](A const& a, V const& v){
+            return point_type(a, v);
+        });
+        std::vector<point_type> new_maxima = function_maxima_detail::parallel_sorted_maxima(sorted, threads);
+        std::vector<point_type> new_minima;
+        if constexpr (Policy::track_minima) {
+            new_minima = function_maxima_detail::parallel_sorted_minima(sorted, threads);
+        }
+        point_set new_points;
+        for(const point_type& p : sorted) {
+            new_points.insert(new_points.end(), p);
+        }
+        replace_points(new_points, new_maxima, new_minima);
+    }
+
+    // This function is no - throw.
+    size_type size() const{
+        return points.size();
+    }
+
+    // This function has Strong Guarantee.
+    V const& value_at(A const& a) const {
+        iterator res_it = points.find(a);
+        if(res_it == points.end()) {
+            throw InvalidArg();
+        }
+        V const& res = (*res_it).value();
+        return res;
+    }
+
+    FunctionMaxima(): points(), maxima(), ranges(), minima(), sink(), to_erase(), to_rollback(), if_erase(), if_rollback(),
+    mn_to_erase(), mn_to_rollback(), mn_if_erase(), mn_if_rollback(), undo_log(), transaction_open(false)
+    {
+        points = point_set();
+        maxima = maxima_set();
+        clear_erase();
+        clear_rollback();
+    }
+
+    // Builds the function from a range of (argument, value) pairs sorted by
+    // arguments, see assign.
+    template<typename Iterator>
+    FunctionMaxima(Iterator first, Iterator last): FunctionMaxima()
+    {
+        assign(first, last);
+    }
+
+
+    FunctionMaxima(const FunctionMaxima& rhs):
+    points(rhs.points),
+    maxima(rhs.maxima),
+    ranges(rhs.ranges),
+    minima(rhs.minima),
+    sink(),
+    to_erase(),
+    to_rollback(),
+    if_erase(),
+    if_rollback(),
+    mn_to_erase(),
+    mn_to_rollback(),
+    mn_if_erase(),
+    mn_if_rollback(),
+    undo_log(),
+    transaction_open(false)
+    {}
+
+    // Exchanges the functions together with their transactions. No-throw.
+    void swap(FunctionMaxima& rhs) noexcept{
+        swap_contents(rhs);
+        std::swap(this->undo_log, rhs.undo_log);
+        std::swap(this->transaction_open, rhs.transaction_open);
+    }
+
+    // Within a transaction the old points are logged to be put back and the new
+    // ones to be erased, as by assign. This function has Strong Guarantee.
+    FunctionMaxima& operator=(const FunctionMaxima& rhs){
+        if(this == &rhs){
+            return *this;
+        }
+        FunctionMaxima temp(rhs);
+        if(transaction_open) {
+            // Rollback erases the new points before it puts the old ones back.
+            function_maxima_detail::reserve_more(undo_log, points.size() + temp.points.size());
+            for(const point_type& p : points) {
+                undo_log.push_back(undo_entry{p, true});
+            }
+            for(const point_type& p : temp.points) {
+                undo_log.push_back(undo_entry{p, false});
+            }
+        }
+        temp.swap_contents(*this);
+        return *this;
+    }
+
+private:
+
+    void swap_contents(FunctionMaxima& rhs) noexcept{
+        std::swap(this->points, rhs.points);
+        std::swap(this->maxima, rhs.maxima);
+        this->ranges.swap(rhs.ranges);
+        std::swap(this->to_erase, rhs.to_erase);
+        std::swap(this->to_rollback, rhs.to_rollback);
+        std::swap(this->if_erase, rhs.if_erase);
+        std::swap(this->if_rollback, rhs.if_rollback);
+        std::swap(this->minima, rhs.minima);
+        std::swap(this->mn_to_erase, rhs.mn_to_erase);
+        std::swap(this->mn_to_rollback, rhs.mn_to_rollback);
+        std::swap(this->mn_if_erase, rhs.mn_if_erase);
+        std::swap(this->mn_if_rollback, rhs.mn_if_rollback);
+    }
+
+};
+
+// Function kept in two sorted arrays, meant for functions that are built once and
+// then mostly queried. Lookups are binary searches and iterating walks contiguous
+// memory, but set_value and erase take O(n) time. The local maxima are exactly the
+// same as the ones of FunctionMaxima.
+template<typename A, typename V, typename Policy = multi_threaded_t>
+class FlatFunctionMaxima{
+
+public:
+
+    using point_type = FunctionPoint<A, V, Policy>;
+
+private:
+
+    using compare_points = function_maxima_detail::compare_points<A, point_type>;
+    using compare_maxima = function_maxima_detail::compare_maxima<point_type>;
+
+public:
+
+    using point_set = std::vector<point_type>;
+    using iterator = typename point_set::const_iterator;
+
+    using maxima_set = std::vector<point_type>;
+    using mx_iterator = typename maxima_set::const_iterator;
+    using mx_view = function_maxima_detail::maxima_view<mx_iterator>;
+
+    using size_type = size_t;
+
+private:
+
+    point_set points;
+    maxima_set maxima;
+
+    // A single operation adds and removes at most this many maxima.
+    static const int MAX_CHANGES = 3;
+
+    // Changes of the set of maxima, gathered before any of the arrays is modified.
+    struct maxima_changes{
+        const point_type* added[MAX_CHANGES];
+        const point_type* removed[MAX_CHANGES];
+        int added_count = 0;
+        int removed_count = 0;
+
+        void add(const point_type& p){
+            added[added_count++] = &p;
+        }
+
+        void remove(const point_type& p){
+            removed[removed_count++] = &p;
+        }
+
+        void sort_added(){
+            function_maxima_detail::sort_small(added, added + added_count,
+                                               [](const point_type* lhs, const point_type* rhs){
+                                                   return compare_maxima()(*lhs, *rhs);
+                                               });
+        }
+    };
+
+    // Values of the neighbours of the point at position i, nullptr if there is none.
+    const V* value_before(size_type i) const noexcept{
+        return i > 0 ? &points[i - 1].value() : nullptr;
+    }
+
+    const V* value_after(size_type i) const noexcept{
+        return i + 1 < points.size() ? &points[i + 1].value() : nullptr;
+    }
+
+    // This function has Strong Guarantee.
+    bool is_maximum(size_type i) const{
+        return function_maxima_detail::is_local_maximum(value_before(i), points[i].value(),
+                                                        value_after(i));
+    }
+
+    // Records the change of status of the point at position i, given the values of
+    // its neighbours after the operation. Strong Guarantee.
+    void update_neighbour(maxima_changes& changes, size_type i, const V* left, const V* right) const{
+        bool was_max = is_maximum(i);
+        bool is_max = function_maxima_detail::is_local_maximum(left, points[i].value(), right);
+        if(was_max && !is_max) changes.remove(points[i]);
+        if(!was_max && is_max) changes.add(points[i]);
+    }
+
+    size_type maxima_position(const point_type& p) const{
+        return std::lower_bound(maxima.begin(), maxima.end(), p, compare_maxima()) - maxima.begin();
+    }
+
+    // Applies the changes to the set of maxima. Everything that may throw is done
+    // before the array is modified, so this function has Strong Guarantee.
+    void apply(maxima_changes& changes){
+        size_type removed_at[MAX_CHANGES];
+        for(int i = 0; i < changes.removed_count; i++) {
+            removed_at[i] = maxima_position(*changes.removed[i]);
+        }
+        function_maxima_detail::sort_small(removed_at, removed_at + changes.removed_count,
+                                           std::less<size_type>());
+        changes.sort_added();
+        size_type added_at[MAX_CHANGES];
+        for(int i = 0; i < changes.added_count; i++) {
+            added_at[i] = maxima_position(*changes.added[i]);
+        }
+        function_maxima_detail::reserve_more(maxima, changes.added_count);
+
+        // No-throw from here on: there is enough room and points are copied without throwing.
+        for(int i = changes.removed_count - 1; i >= 0; i--) {
+            maxima.erase(maxima.begin() + removed_at[i]);
+        }
+        for(int i = 0; i < changes.added_count; i++) {
+            size_type position = added_at[i] + i;
+            for(int j = 0; j < changes.removed_count; j++) {
+                if(removed_at[j] < added_at[i]) position--;
+            }
+            maxima.insert(maxima.begin() + position, *changes.added[i]);
+        }
+    }
+
+    size_type position(A const& a) const{
+        return std::lower_bound(points.begin(), points.end(), a, compare_points()) - points.begin();
+    }
+
+    bool present_at(size_type i, A const& a) const{
+        return i < points.size() && !(a < points[i].arg());
+    }
+
+public:
+
+    // This function has Strong Guarantee.
+    void set_value(A const& a, V const& v){
+        size_type i = position(a);
+        bool found = present_at(i, a);
+        if(found && function_maxima_detail::equivalent(v, points[i].value())) return;
+        // Reserved before taking the addresses of points into the changes.
+        if(!found) function_maxima_detail::reserve_more(points, 1);
+        point_type p(a, v);
+
+        maxima_changes changes;
+        bool has_left = i > 0;
+        size_type right = found ? i + 1 : i;
+        bool has_right = right < points.size();
+        const V* left_value = has_left ? &points[i - 1].value() : nullptr;
+        const V* right_value = has_right ? &points[right].value() : nullptr;
+
+        if(found && is_maximum(i)) changes.remove(points[i]);
+        if(function_maxima_detail::is_local_maximum(left_value, v, right_value)) changes.add(p);
+        if(has_left) update_neighbour(changes, i - 1, value_before(i - 1), &p.value());
+        if(has_right) update_neighbour(changes, right, &p.value(), value_after(right));
+        apply(changes);
+
+        if(found) points[i] = std::move(p);
+        else points.insert(points.begin() + i, std::move(p));
+    }
+
+    // This function has Strong Guarantee.
+    void erase(A const& a){
+        size_type i = position(a);
+        if(!present_at(i, a)) return;
+
+        maxima_changes changes;
+        if(is_maximum(i)) changes.remove(points[i]);
+        if(i > 0) update_neighbour(changes, i - 1, value_before(i - 1), value_after(i));
+        if(i + 1 < points.size()) update_neighbour(changes, i + 1, value_before(i), value_after(i + 1));
+        apply(changes);
+
+        points.erase(points.begin() + i);
+    }
+
+    // Erases all the points with arguments in [lo, hi). The run is removed from the
+    // array at once and the maxima are filtered in a single pass, only the two points
+    // around the run are re-evaluated. This function has Strong Guarantee.
+    void erase_range(A const& lo, A const& hi){
+        if(!(lo < hi)) return;
+        size_type first = position(lo);
+        size_type last = position(hi);
+        if(first == last) return;
+
+        maxima_changes changes;
+        const V* left_value = value_before(first);
+        const V* right_value = last < points.size() ? &points[last].value() : nullptr;
+        if(first > 0) update_neighbour(changes, first - 1, value_before(first - 1), right_value);
+        if(last < points.size()) update_neighbour(changes, last, left_value, value_after(last));
+        changes.sort_added();
+
+        auto removed = [&](const point_type& p){
+            if(!(p.arg() < lo) && p.arg() < hi) return true;
+            for(int i = 0; i < changes.removed_count; i++) {
+                const A& arg = changes.removed[i]->arg();
+                if(!(p.arg() < arg) && !(arg < p.arg())) return true;
+            }
+            return false;
+        };
+        maxima_set new_maxima;
+        new_maxima.reserve(maxima.size() + changes.added_count);
+        int added = 0;
+        for(const point_type& p : maxima) {
+            while(added < changes.added_count && compare_maxima()(*changes.added[added], p)) {
+                new_maxima.push_back(*changes.added[added++]);
+            }
+            if(!removed(p)) new_maxima.push_back(p);
+        }
+        for(; added < changes.added_count; added++) {
+            new_maxima.push_back(*changes.added[added]);
+        }
+
+        points.erase(points.begin() + first, points.begin() + last);
+        maxima.swap(new_maxima);
+    }
+
+    // Sets the values of a whole batch of (argument, value) pairs, as if set_value
+    // was called for each of them in turn. The batch is merged into the points in a
+    // single pass and the maxima are rebuilt once, instead of shifting the arrays
+    // once per pair. This function has Strong Guarantee for the whole batch.
+    template<typename Iterator>
+    void set_values(Iterator first, Iterator last){
+        std::vector<point_type> updates = function_maxima_detail::sorted_updates<point_type>(
+            first, last, [](A const& a, V const& v){
+                return point_type(a, v);
+            });
+        if(updates.empty()) return;
+
+        point_set new_points;
+        new_points.reserve(points.size() + updates.size());
+        auto old_it = points.begin();
+        for(const point_type& p : updates) {
+            while(old_it != points.end() && (*old_it).arg() < p.arg()) {
+                new_points.push_back(*old_it++);
+            }
+            if(old_it != points.end() && !(p.arg() < (*old_it).arg())) {
+                bool same = function_maxima_detail::equivalent(p.value(), (*old_it).value());
+                new_points.push_back(same ? *old_it : p);
+                ++old_it;
+            }
+            else {
+                new_points.push_back(p);
+            }
+        }
+        new_points.insert(new_points.end(), old_it, points.end());
+        maxima_set new_maxima =
+            function_maxima_detail::sorted_maxima<point_type>(new_points.begin(), new_points.end());
+
+        points.swap(new_points);
+        maxima.swap(new_maxima);
+    }
+
+    // Replaces the function with the one given by a range of (argument, value) pairs
+    // sorted by arguments, in O(n) time apart from sorting the maxima. See
+    // FunctionMaxima::assign. This function has Strong Guarantee.
+    template<typename Iterator>
+    void assign(Iterator first, Iterator last){
+        point_set new_points;
+        function_maxima_detail::append_sorted(new_points, first, last, [](A const& a, V const& v){
+            return point_type(a, v);
+        });
+        maxima_set new_maxima =
+            function_maxima_detail::sorted_maxima<point_type>(new_points.begin(), new_points.end());
+
+        points.swap(new_points);
+        maxima.swap(new_maxima);
+    }
+
+    // Same as assign, but the local maxima are found and sorted by the given number
+    // of threads, see FunctionMaxima::assign. Strong Guarantee.
+    template<typename Iterator>
+    void assign(Iterator first, Iterator last, size_type threads){
+        point_set new_points;
+        function_maxima_detail::append_sorted(new_points, first, last, [](A const& a, V const& v){
+            return point_type(a, v);
+        });
+        maxima_set new_maxima = function_maxima_detail::parallel_sorted_maxima(new_points, threads);
+
+        points.swap(new_points);
+        maxima.swap(new_maxima);
+    }
+
+    iterator begin() const noexcept{
+        return points.begin();
+    }
+
+    iterator end() const noexcept{
+        return points.end();
+    }
+
+    iterator find(A const& a) const{
+        size_type i = position(a);
+        return present_at(i, a) ? points.begin() + i : points.end();
+    }
+
+    mx_iterator mx_begin() const noexcept{
+        return maxima.begin();
+    }
+
+    mx_iterator mx_end() const noexcept{
+        return maxima.end();
+    }
+
+    // See FunctionMaxima::global_max, top and top_k, which take the same time here.
+    point_type const& global_max() const{
+        if(maxima.empty()) {
+            throw InvalidArg();
+        }
+        return *maxima.begin();
+    }
+
+    point_type const& top() const{
+        return global_max();
+    }
+
+    mx_view top_k(size_type k) const noexcept{
+        return function_maxima_detail::first_k(maxima.begin(), maxima.end(), k);
+    }
+
+    // This function is no - throw.
+    size_type size() const{
+        return points.size();
+    }
+
+    // This function has Strong Guarantee.
+    V const& value_at(A const& a) const {
+        size_type i = position(a);
+        if(!present_at(i, a)) {
+            throw InvalidArg();
+        }
+        return points[i].value();
+    }
+
+    FlatFunctionMaxima() = default;
+
+    FlatFunctionMaxima(const FlatFunctionMaxima& rhs) = default;
+
+    // Builds the function from a range of (argument, value) pairs sorted by
+    // arguments, see assign.
+    template<typename Iterator>
+    FlatFunctionMaxima(Iterator first, Iterator last): FlatFunctionMaxima()
+    {
+        assign(first, last);
+    }
+
+    // Flattens a function, sharing its points.
+    explicit FlatFunctionMaxima(const FunctionMaxima<A, V, Policy>& function):
+    points(function.begin(), function.end()),
+    maxima(function.mx_begin(), function.mx_end())
+    {}
+
+    void swap(FlatFunctionMaxima& rhs) noexcept{
+        points.swap(rhs.points);
+        maxima.swap(rhs.maxima);
+    }
+
+    FlatFunctionMaxima& operator=(const FlatFunctionMaxima& rhs){
+        if(this == &rhs){
+            return *this;
+        }
+        FlatFunctionMaxima temp(rhs);
+        temp.swap(*this);
+        return *this;
+    }
+
+};
+
+// Function of an integral argument from a range [low, high) known in advance. Points
+// live in an array indexed directly by the argument, with a bitmap of the arguments
+// present in the domain and another one of the local maxima. value_at takes O(1) time,
+// looking for the neighbours of a point scans the bitmap a word at a time. The local
+// maxima are exactly the same as the ones of FunctionMaxima.
+template<typename A, typename V, typename Policy = multi_threaded_t>
+class DenseFunctionMaxima{
+
+    static_assert(std::is_integral<A>::value, "arguments of DenseFunctionMaxima must be integral");
+
+public:
+
+    using point_type = FunctionPoint<A, V, Policy>;
+    using size_type = size_t;
+
+private:
+
+    using compare_maxima = function_maxima_detail::compare_maxima<point_type>;
+    using bitmap = function_maxima_detail::bitmap;
+
+    // Uninitialised room for a point.
+    struct slot{
+        alignas(point_type) std::byte buf[sizeof(point_type)];
+    };
+
+public:
+
+    using maxima_set = std::set<point_type, compare_maxima, typename Policy::template allocator<point_type>>;
+    using mx_iterator = typename maxima_set::const_iterator;
+    using mx_view = function_maxima_detail::maxima_view<mx_iterator>;
+
+    class iterator{
+
+        const DenseFunctionMaxima* function;
+        size_type index;
+
+        iterator(const DenseFunctionMaxima* f, size_type i): function(f), index(i) {}
+
+        friend class DenseFunctionMaxima;
+
+    public:
+
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = point_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const point_type*;
+        using reference = const point_type&;
+
+        iterator(): function(nullptr), index(0) {}
+
+        reference operator*() const{
+            return function->point(index);
+        }
+
+        pointer operator->() const{
+            return &function->point(index);
+        }
+
+        iterator& operator++(){
+            index = function->present.next(index + 1);
+            return *this;
+        }
+
+        iterator operator++(int){
+            iterator result = *this;
+            ++*this;
+            return result;
+        }
+
+        iterator& operator--(){
+            index = function->present.prev(index);
+            return *this;
+        }
+
+        iterator operator--(int){
+            iterator result = *this;
+            --*this;
+            return result;
+        }
+
+        bool operator==(const iterator& rhs) const{
+            return index == rhs.index;
+        }
+
+        bool operator!=(const iterator& rhs) const{
+            return !(*this == rhs);
+        }
+    };
+
+private:
+
+    A low;
+    size_type domain;
+    std::unique_ptr<slot[]> slots;
+    bitmap present;
+    bitmap maximal;
+    maxima_set maxima;
+    size_type count;
+
+    // A single operation adds and removes at most this many maxima.
+    static const int MAX_CHANGES = 3;
+
+    const point_type& point(size_type i) const noexcept{
+        return *std::launder(reinterpret_cast<const point_type*>(slots[i].buf));
+    }
+
+    point_type& point(size_type i) noexcept{
+        return *std::launder(reinterpret_cast<point_type*>(slots[i].buf));
+    }
+
+    // Computes to - from for from <= to without overflowing signed types.
+    static size_type distance(A from, A to) noexcept{
+        using unsigned_type = typename std::make_unsigned<A>::type;
+        unsigned_type difference = static_cast<unsigned_type>(to) - static_cast<unsigned_type>(from);
+        return static_cast<size_type>(difference);
+    }
+
+    // Position of a in the array, or domain if a lies outside of it.
+    size_type index_of(A const& a) const noexcept{
+        if(a < low || distance(low, a) >= domain) return domain;
+        return distance(low, a);
+    }
+
+    // Position of the first argument not less than a, clamped to the domain.
+    size_type lower_index(A const& a) const noexcept{
+        if(a < low) return 0;
+        return std::min(distance(low, a), domain);
+    }
+
+    const V* value_of(size_type i) const noexcept{
+        return i < domain ? &point(i).value() : nullptr;
+    }
+
+    // Brings the maxima up to date with position i holding p (or nothing if p is
+    // nullptr), given the positions of its neighbours. Strong Guarantee.
+    void update_maxima(size_type i, const point_type* p, size_type left, size_type right){
+        const point_type* added[MAX_CHANGES];
+        mx_iterator removed[MAX_CHANGES];
+        int added_count = 0;
+        int removed_count = 0;
+
+        bool was_max = present.test(i) && maximal.test(i);
+        if(was_max) removed[removed_count++] = maxima.find(point(i));
+
+        const V* left_value = value_of(left);
+        const V* right_value = value_of(right);
+        bool is_max = p != nullptr &&
+                      function_maxima_detail::is_local_maximum(left_value, p->value(), right_value);
+        if(is_max) added[added_count++] = p;
+
+        // The value each neighbour will see in place of position i.
+        const V* middle_for_left = p != nullptr ? &p->value() : right_value;
+        const V* middle_for_right = p != nullptr ? &p->value() : left_value;
+        bool left_flips = left != domain &&
+            update_neighbour(left, value_of(present.prev(left)), middle_for_left,
+                             added, added_count, removed, removed_count);
+        bool right_flips = right != domain &&
+            update_neighbour(right, middle_for_right, value_of(present.next(right + 1)),
+                             added, added_count, removed, removed_count);
+
+        mx_iterator inserted[MAX_CHANGES];
+        int inserted_count = 0;
+        try {
+            for(; inserted_count < added_count; inserted_count++) {
+                inserted[inserted_count] = maxima.insert(*added[inserted_count]).first;
+            }
+        }
+        catch(...) {
+            for(int j = 0; j < inserted_count; j++) {
+                maxima.erase(inserted[j]);
+            }
+            throw;
+        }
+
+        // No-throw from here on.
+        for(int j = 0; j < removed_count; j++) {
+            maxima.erase(removed[j]);
+        }
+        if(left_flips) maximal.flip(left);
+        if(right_flips) maximal.flip(right);
+        if(was_max != is_max) maximal.flip(i);
+    }
+
+    // Records the change of status of the point at position n, given the values of
+    // its neighbours after the operation. Returns whether the status changes.
+    bool update_neighbour(size_type n, const V* before, const V* after,
+                          const point_type** added, int& added_count,
+                          mx_iterator* removed, int& removed_count) const{
+        bool was_max = maximal.test(n);
+        bool is_max = function_maxima_detail::is_local_maximum(before, point(n).value(), after);
+        if(was_max && !is_max) removed[removed_count++] = maxima.find(point(n));
+        if(!was_max && is_max) added[added_count++] = &point(n);
+        return was_max != is_max;
+    }
+
+public:
+
+    // This function has Strong Guarantee. Throws InvalidArg if a lies outside of
+    // the range given to the constructor.
+    void set_value(A const& a, V const& v){
+        size_type i = index_of(a);
+        if(i == domain) {
+            throw InvalidArg();
+        }
+        bool found = present.test(i);
+        if(found && function_maxima_detail::equivalent(v, point(i).value())) return;
+        point_type p(a, v);
+
+        update_maxima(i, &p, present.prev(i), present.next(i + 1));
+
+        if(found) {
+            point(i) = std::move(p);
+        }
+        else {
+            ::new (static_cast<void*>(slots[i].buf)) point_type(std::move(p));
+            present.flip(i);
+            count++;
+        }
+    }
+
+    // This function has Strong Guarantee.
+    void erase(A const& a){
+        size_type i = index_of(a);
+        if(i == domain || !present.test(i)) return;
+
+        update_maxima(i, nullptr, present.prev(i), present.next(i + 1));
+
+        point(i).~point_type();
+        present.flip(i);
+        count--;
+    }
+
+    // Erases all the points with arguments in [lo, hi). The points of the run are
+    // found in the bitmap, only the ones that are local maxima are looked up in the
+    // set of maxima and only the two points around the run are re-evaluated.
+    // This function has Strong Guarantee.
+    void erase_range(A const& lo, A const& hi){
+        if(!(lo < hi)) return;
+        size_type first = present.next(lower_index(lo));
+        size_type last = lower_index(hi);
+        if(first >= last) return;
+
+        std::vector<mx_iterator> erased;
+        for(size_type i = first; i < last; i = present.next(i + 1)) {
+            if(maximal.test(i)) erased.push_back(maxima.find(point(i)));
+        }
+
+        const point_type* added[MAX_CHANGES];
+        mx_iterator removed[MAX_CHANGES];
+        int added_count = 0;
+        int removed_count = 0;
+        size_type left = present.prev(first);
+        size_type right = present.next(last);
+        bool left_flips = left != domain &&
+            update_neighbour(left, value_of(present.prev(left)), value_of(right),
+                             added, added_count, removed, removed_count);
+        bool right_flips = right != domain &&
+            update_neighbour(right, value_of(left), value_of(present.next(right + 1)),
+                             added, added_count, removed, removed_count);
+
+        mx_iterator inserted[MAX_CHANGES];
+        int inserted_count = 0;
+        try {
+            for(; inserted_count < added_count; inserted_count++) {
+                inserted[inserted_count] = maxima.insert(*added[inserted_count]).first;
+            }
+        }
+        catch(...) {
+            for(int j = 0; j < inserted_count; j++) {
+                maxima.erase(inserted[j]);
+            }
+            throw;
+        }
+
+        // No-throw from here on.
+        for(mx_iterator it : erased) {
+            maxima.erase(it);
+        }
+        for(int j = 0; j < removed_count; j++) {
+            maxima.erase(removed[j]);
+        }
+        if(left_flips) maximal.flip(left);
+        if(right_flips) maximal.flip(right);
+        for(size_type i = first; i < last; i = present.next(i + 1)) {
+            point(i).~point_type();
+            present.flip(i);
+            if(maximal.test(i)) maximal.flip(i);
+            count--;
+        }
+    }
+
+    iterator begin() const noexcept{
+        return iterator(this, present.next(0));
+    }
+
+    iterator end() const noexcept{
+        return iterator(this, domain);
+    }
+
+    iterator find(A const& a) const{
+        size_type i = index_of(a);
+        return i != domain && present.test(i) ? iterator(this, i) : end();
+    }
+
+    mx_iterator mx_begin() const noexcept{
+        return maxima.begin();
+    }
+
+    mx_iterator mx_end() const noexcept{
+        return maxima.end();
+    }
+
+    // See FunctionMaxima::global_max, top and top_k, which take the same time here.
+    point_type const& global_max() const{
+        if(maxima.empty()) {
+            throw InvalidArg();
+        }
+        return *maxima.begin();
+    }
+
+    point_type const& top() const{
+        return global_max();
+    }
+
+    mx_view top_k(size_type k) const noexcept{
+        return function_maxima_detail::first_k(maxima.begin(), maxima.end(), k);
+    }
+
+    // This function is no - throw.
+    size_type size() const{
+        return count;
+    }
+
+    // This function has Strong Guarantee.
+    V const& value_at(A const& a) const {
+        size_type i = index_of(a);
+        if(i == domain || !present.test(i)) {
+            throw InvalidArg();
+        }
+        return point(i).value();
+    }
+
+    // Creates a function with an empty domain, in which no argument can be set.
+    DenseFunctionMaxima(): DenseFunctionMaxima(A(), A()) {}
+
+    // Creates an empty function whose arguments may come from [low, high).
+    DenseFunctionMaxima(A low_, A high_):
+    low(low_),
+    domain(low_ < high_ ? distance(low_, high_) : 0),
+    slots(new slot[domain]),
+    present(domain),
+    maximal(domain),
+    maxima(),
+    count(0)
+    {}
+
+    DenseFunctionMaxima(const DenseFunctionMaxima& rhs):
+    low(rhs.low),
+    domain(rhs.domain),
+    slots(new slot[rhs.domain]),
+    present(rhs.present),
+    maximal(rhs.maximal),
+    maxima(rhs.maxima),
+    count(rhs.count)
+    {
+        // Copying points never throws.
+        for(size_type i = present.next(0); i != domain; i = present.next(i + 1)) {
+            ::new (static_cast<void*>(slots[i].buf)) point_type(rhs.point(i));
+        }
+    }
+
+    ~DenseFunctionMaxima(){
+        for(size_type i = present.next(0); i != domain; i = present.next(i + 1)) {
+            point(i).~point_type();
+        }
+    }
+
+    void swap(DenseFunctionMaxima& rhs) noexcept{
+        std::swap(this->low, rhs.low);
+        std::swap(this->domain, rhs.domain);
+        std::swap(this->slots, rhs.slots);
+        std::swap(this->present, rhs.present);
+        std::swap(this->maximal, rhs.maximal);
+        std::swap(this->maxima, rhs.maxima);
+        std::swap(this->count, rhs.count);
+    }
+
+    DenseFunctionMaxima& operator=(const DenseFunctionMaxima& rhs){
+        if(this == &rhs){
+            return *this;
+        }
+        DenseFunctionMaxima temp(rhs);
+        temp.swap(*this);
+        return *this;
+    }
+
+};
+
+// Function kept in persistent trees whose nodes are shared between the copies of the
+// function. Copying it takes O(1) time and a modification copies only the O(log n)
+// nodes on the paths it changes, which suits keeping many versions of a function,
+// e.g. a copy for every query epoch. Lookups and iterating are somewhat slower than
+// in FunctionMaxima. The local maxima are exactly the same as the ones of FunctionMaxima.
+template<typename A, typename V, typename Policy = multi_threaded_t>
+class PersistentFunctionMaxima{
+
+public:
+
+    using point_type = FunctionPoint<A, V, Policy>;
+
+private:
+
+    using compare_points = function_maxima_detail::compare_points<A, point_type>;
+    using compare_maxima = function_maxima_detail::compare_maxima<point_type>;
+
+public:
+
+    using point_set = function_maxima_detail::persistent_set<point_type, compare_points, Policy>;
+    using iterator = typename point_set::const_iterator;
+
+    using maxima_set = function_maxima_detail::persistent_set<point_type, compare_maxima, Policy>;
+    using mx_iterator = typename maxima_set::const_iterator;
+    using mx_view = function_maxima_detail::maxima_view<mx_iterator>;
+
+    using size_type = size_t;
+
+private:
+
+    point_set points;
+    maxima_set maxima;
+
+    // Values of the neighbours of the point at it, nullptr if there is none.
+    const V* value_before(iterator it) const noexcept{
+        return it == points.begin() ? nullptr : &(--it)->value();
+    }
+
+    const V* value_after(iterator it) const noexcept{
+        ++it;
+        return it == points.end() ? nullptr : &it->value();
+    }
+
+    // Records the change of status of the point at it in new_maxima, given the values
+    // of its neighbours after the operation. Strong Guarantee.
+    void update_neighbour(maxima_set& new_maxima, iterator it, const V* left, const V* right) const{
+        bool was_max = function_maxima_detail::is_local_maximum(value_before(it), it->value(),
+                                                                value_after(it));
+        bool is_max = function_maxima_detail::is_local_maximum(left, it->value(), right);
+        if(was_max && !is_max) new_maxima = new_maxima.erased(*it);
+        if(!was_max && is_max) new_maxima = new_maxima.inserted(*it);
+    }
+
+public:
+
+    // The new versions of both trees are built aside and swapped in at the end, so
+    // this function has Strong Guarantee.
+    void set_value(A const& a, V const& v){
+        iterator it = points.lower_bound(a);
+        bool found = it != points.end() && !(a < it->arg());
+        if(found && function_maxima_detail::equivalent(v, it->value())) return;
+        point_type p(a, v);
+
+        iterator left = it;
+        bool has_left = it != points.begin();
+        if(has_left) --left;
+        iterator right = it;
+        if(found) ++right;
+        bool has_right = right != points.end();
+        const V* left_value = has_left ? &left->value() : nullptr;
+        const V* right_value = has_right ? &right->value() : nullptr;
+
+        maxima_set new_maxima(maxima);
+        if(found && function_maxima_detail::is_local_maximum(left_value, it->value(), right_value)) {
+            new_maxima = new_maxima.erased(*it);
+        }
+        if(function_maxima_detail::is_local_maximum(left_value, v, right_value)) {
+            new_maxima = new_maxima.inserted(p);
+        }
+        if(has_left) update_neighbour(new_maxima, left, value_before(left), &p.value());
+        if(has_right) update_neighbour(new_maxima, right, &p.value(), value_after(right));
+        point_set new_points = points.inserted(p);
+
+        points.swap(new_points);
+        maxima.swap(new_maxima);
+    }
+
+    // This function has Strong Guarantee.
+    void erase(A const& a){
+        iterator it = points.find(a);
+        if(it == points.end()) return;
+
+        iterator left = it;
+        bool has_left = it != points.begin();
+        if(has_left) --left;
+        iterator right = it;
+        ++right;
+        bool has_right = right != points.end();
+        const V* left_value = has_left ? &left->value() : nullptr;
+        const V* right_value = has_right ? &right->value() : nullptr;
+
+        maxima_set new_maxima(maxima);
+        if(function_maxima_detail::is_local_maximum(left_value, it->value(), right_value)) {
+            new_maxima = new_maxima.erased(*it);
+        }
+        if(has_left) update_neighbour(new_maxima, left, value_before(left), right_value);
+        if(has_right) update_neighbour(new_maxima, right, left_value, value_after(right));
+        point_set new_points = points.erased(a);
+
+        points.swap(new_points);
+        maxima.swap(new_maxima);
+    }
+
+    // Replaces the function with the one given by a range of (argument, value) pairs
+    // sorted by arguments, in O(n) time apart from sorting the maxima. See
+    // FunctionMaxima::assign. This function has Strong Guarantee.
+    template<typename Iterator>
+    void assign(Iterator first, Iterator last){
+        std::vector<point_type> sorted;
+        function_maxima_detail::append_sorted(sorted, first, last, [](A const& a, V const& v){
+            return point_type(a, v);
+        });
+        point_set new_points = point_set::from_sorted(sorted);
+        maxima_set new_maxima = maxima_set::from_sorted(
+            function_maxima_detail::sorted_maxima<point_type>(sorted.begin(), sorted.end()));
+
+        points.swap(new_points);
+        maxima.swap(new_maxima);
+    }
+
+    // Same as assign, but the local maxima are found and sorted by the given number
+    // of threads, see FunctionMaxima::assign. Strong Guarantee.
+    template<typename Iterator>
+    void assign(Iterator first, Iterator last, size_type threads){
+        std::vector<point_type> sorted;
+        function_maxima_detail::append_sorted(sorted, first, last, [](A const& a, V const& v){
+            return point_type(a, v);
+        });
+        point_set new_points = point_set::from_sorted(sorted);
+        maxima_set new_maxima = maxima_set::from_sorted(
+            function_maxima_detail::parallel_sorted_maxima(sorted, threads));
+
+        points.swap(new_points);
+        maxima.swap(new_maxima);
+    }
+
+    iterator begin() const noexcept{
+        return points.begin();
+    }
+
+    iterator end() const noexcept{
+        return points.end();
+    }
+
+    iterator find(A const& a) const{
+        return points.find(a);
+    }
+
+    mx_iterator mx_begin() const noexcept{
+        return maxima.begin();
+    }
+
+    mx_iterator mx_end() const noexcept{
+        return maxima.end();
+    }
+
+    // See FunctionMaxima::global_max, top and top_k. The greatest maximum is found
+    // at the bottom of the tree, so global_max and top take O(log n) time here and
+    // top_k takes O(k + log n).
+    point_type const& global_max() const{
+        if(maxima.empty()) {
+            throw InvalidArg();
+        }
+        return *maxima.begin();
+    }
+
+    point_type const& top() const{
+        return global_max();
+    }
+
+    mx_view top_k(size_type k) const noexcept{
+        return function_maxima_detail::first_k(maxima.begin(), maxima.end(), k);
+    }
+
+    // An immutable version of the function. value_at, find and iterating over the
+    // maxima of a snapshot are not affected by later modifications of the function,
+    // and the nodes it shares with other versions are released with its last handle.
+    // With multi_threaded_t snapshots may be read by other threads while the function
+    // is being modified.
+    using snapshot_type = std::shared_ptr<const PersistentFunctionMaxima>;
+
+    // Takes O(1) time. Strong Guarantee.
+    snapshot_type snapshot() const{
+        return std::make_shared<const PersistentFunctionMaxima>(*this);
+    }
+
+    // This function is no - throw.
+    size_type size() const{
+        return points.size();
+    }
+
+    // This function has Strong Guarantee.
+    V const& value_at(A const& a) const {
+        iterator it = points.find(a);
+        if(it == points.end()) {
+            throw InvalidArg();
+        }
+        return it->value();
+    }
+
+    PersistentFunctionMaxima() = default;
+
+    // Shares all the nodes of rhs. No-throw.
+    PersistentFunctionMaxima(const PersistentFunctionMaxima& rhs) = default;
+
+    // Builds the function from a range of (argument, value) pairs sorted by
+    // arguments, see assign.
+    template<typename Iterator>
+    PersistentFunctionMaxima(Iterator first, Iterator last): PersistentFunctionMaxima()
+    {
+        assign(first, last);
+    }
+
+    // Copies a function into persistent trees in O(n) time, sharing its points.
+    explicit PersistentFunctionMaxima(const FunctionMaxima<A, V, Policy>& function):
+    points(point_set::from_sorted(std::vector<point_type>(function.begin(), function.end()))),
+    maxima(maxima_set::from_sorted(std::vector<point_type>(function.mx_begin(), function.mx_end())))
+    {}
+
+    void swap(PersistentFunctionMaxima& rhs) noexcept{
+        points.swap(rhs.points);
+        maxima.swap(rhs.maxima);
+    }
+
+    // Shares all the nodes of rhs. No-throw.
+    PersistentFunctionMaxima& operator=(const PersistentFunctionMaxima& rhs) noexcept{
+        if(this == &rhs){
+            return *this;
+        }
+        PersistentFunctionMaxima temp(rhs);
+        temp.swap(*this);
+        return *this;
+    }
+
+};
+
+// Function whose argument domain is split into shards at given boundaries, each of
+// them an ordinary FunctionMaxima with its own lock, so that threads updating
+// different shards do not wait for each other. A point is a local maximum exactly
+// when it is one for FunctionMaxima: the first and last points of a shard are
+// compared with their neighbours from other shards when the maxima are read.
+template<typename A, typename V, typename Policy = multi_threaded_t>
+class ConcurrentFunctionMaxima{
+
+public:
+
+    using shard_type = FunctionMaxima<A, V, Policy>;
+    using point_type = typename shard_type::point_type;
+    using size_type = size_t;
 
-        std::shared_ptr<A> argument;
-        std::shared_ptr<V> val;
+private:
 
-    private:
+    struct shard{
+        shard_type function;
+        mutable std::mutex lock;
+    };
 
-        point_type(const A& a, const  V& v)
-        {
-            argument = std::make_shared<A>(a);
-            val = std::make_shared<V>(v);
+    // Shard i keeps the arguments from [boundaries[i - 1], boundaries[i]).
+    std::vector<A> boundaries;
+    std::vector<std::unique_ptr<shard>> shards;
+
+    shard& shard_of(A const& a) const{
+        size_type i = std::upper_bound(boundaries.begin(), boundaries.end(), a) - boundaries.begin();
+        return *shards[i];
+    }
+
+    // Locks all the shards, always in the same order.
+    std::vector<std::unique_lock<std::mutex>> lock_all() const{
+        std::vector<std::unique_lock<std::mutex>> locks;
+        locks.reserve(shards.size());
+        for(const auto& s : shards) {
+            locks.emplace_back(s->lock);
         }
+        return locks;
+    }
 
-        friend class FunctionMaxima;
+public:
 
-    public:
+    // Local maxima of the whole function in the order of FunctionMaxima::mx_begin,
+    // merged from the shards as they are iterated. The view holds the locks of all
+    // the shards, so the function cannot be modified while it exists.
+    class mx_view{
 
-        A const& arg() const{
-            return *argument;
-        }
+        using shard_iterator = typename shard_type::mx_iterator;
 
-        V const& value() const{
-            return *val;
-        }
+        // Maxima of a shard, without its boundary points that turn out not to be
+        // maxima of the whole function.
+        struct source{
+            shard_iterator first;
+            shard_iterator last;
+            const A* excluded[2];
+            int excluded_count;
 
-        point_type& operator=(const point_type &rhs){
-            if(this == &rhs){
-                return *this;
+            bool skipped(const point_type& p) const{
+                for(int i = 0; i < excluded_count; i++) {
+                    if(!(p.arg() < *excluded[i]) && !(*excluded[i] < p.arg())) return true;
+                }
+                return false;
             }
-            argument = rhs.argument;
-            val = rhs.val;
-            return *this;
-        }
+        };
 
-        point_type(const point_type& rhs):
-        argument(rhs.argument),
-        val(rhs.val)
-        {}
+    public:
 
-    };
+        class iterator{
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = point_type;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const point_type*;
+            using reference = const point_type&;
 
+            reference operator*() const noexcept{
+                return *heap.front().first;
+            }
 
-private:
+            pointer operator->() const noexcept{
+                return &*heap.front().first;
+            }
 
-    struct compare_points{
+            // Takes O(log k) time for k shards. Strong Guarantee.
+            iterator& operator++(){
+                std::pop_heap(heap.begin(), heap.end(), later);
+                cursor& c = heap.back();
+                if(advance(c)) std::push_heap(heap.begin(), heap.end(), later);
+                else heap.pop_back();
+                return *this;
+            }
 
-        using is_transparent = void;
-        bool operator()(const point_type& lhs, const point_type& rhs) const {
-            return lhs.arg() < rhs.arg();
-        }
+            iterator operator++(int){
+                iterator result(*this);
+                ++*this;
+                return result;
+            }
 
-        bool operator()(const A& lhs, const point_type& rhs) const {
-            return lhs < rhs.arg();
-        }
-        bool operator()(const point_type& lhs, const A& rhs) const {
-            return lhs.arg() < rhs;
-        }
-    };
+            bool operator==(const iterator& rhs) const noexcept{
+                return heap.size() == rhs.heap.size() &&
+                       (heap.empty() || heap.front().first == rhs.heap.front().first);
+            }
 
-    struct compare_maxima{
-        using is_transparent = void;
-        bool operator()(const point_type& lhs, const point_type& rhs) const{
-            if (rhs.value() < lhs.value()) return true;
-            else if (lhs.value() < rhs.value()) return false;
-            return lhs.arg() < rhs.arg();
-        }
-    };
+            bool operator!=(const iterator& rhs) const noexcept{
+                return !(*this == rhs);
+            }
 
+        private:
+            // Position in the maxima of a shard.
+            using cursor = std::pair<shard_iterator, const source*>;
 
-public:
-    using point_set = std::multiset<point_type, compare_points>;
-    using iterator = typename point_set::const_iterator;
+            static bool later(const cursor& lhs, const cursor& rhs){
+                return function_maxima_detail::compare_maxima<point_type>()(*rhs.first, *lhs.first);
+            }
 
-    using maxima_set = std::set<point_type, compare_maxima>;
-    using mx_iterator = typename maxima_set::const_iterator;
+            // Skips the excluded points, returns false at the end of the shard.
+            static bool skip(cursor& c){
+                while(c.first != c.second->last && c.second->skipped(*c.first)) ++c.first;
+                return c.first != c.second->last;
+            }
 
-private:
+            static bool advance(cursor& c){
+                ++c.first;
+                return skip(c);
+            }
 
-    point_set points;
-    maxima_set maxima;
+            iterator() = default;
 
-    // Sizes of buffers that are necessary for strong exception guarantee and
-    // performing rollbacks of function operations.
-    static const int NUMBER_TO_ERASE  = 5;
-    static const int NUMBER_TO_ROLLBACK = 4;
+            explicit iterator(const std::vector<source>& sources){
+                heap.reserve(sources.size());
+                for(const source& s : sources) {
+                    cursor c(s.first, &s);
+                    if(skip(c)) heap.push_back(c);
+                }
+                std::make_heap(heap.begin(), heap.end(), later);
+            }
 
-    // Buffer necessary for strong exception guarantee in operations.
-    mx_iterator to_erase[NUMBER_TO_ERASE];
-    // Buffer necessary for performing rollbacks of function operations and.
-    mx_iterator to_rollback[NUMBER_TO_ROLLBACK];
-    bool if_erase[NUMBER_TO_ERASE];
-    bool if_rollback[NUMBER_TO_ROLLBACK];
+            std::vector<cursor> heap;
 
-    // Resets the buffers to their default states.
-    void clear_erase() {
-        for(int i = 0; i < NUMBER_TO_ERASE; i++) {
-            if_erase[i] = false;
-        }
-    }
+            friend class mx_view;
+        };
 
-    void clear_rollback() {
-        for(int i = 0; i < NUMBER_TO_ROLLBACK; i++) {
-            if_rollback[i] = false;
+        iterator begin() const{
+            return iterator(sources);
         }
-    }
 
-    // Rolling back the additions to the set of maxima.
-    void rollback_maxima() {
-        for(int i = 0; i < NUMBER_TO_ROLLBACK; i++) {
-            if(if_rollback[i]) {
-                maxima.erase(to_rollback[i]);
-            }
+        iterator end() const noexcept{
+            return iterator();
         }
-    }
 
-    // No-throw.
-    void erase_from_maxima() {
-        for(int i = 0; i < NUMBER_TO_ERASE; i++) {
-            if(if_erase[i]) {
-                maxima.erase(to_erase[i]);
+    private:
+
+        explicit mx_view(const ConcurrentFunctionMaxima& function):
+        locks(function.lock_all())
+        {
+            const auto& shards = function.shards;
+            sources.reserve(shards.size());
+            for(const auto& s : shards) {
+                const shard_type& f = s->function;
+                sources.push_back(source{f.mx_begin(), f.mx_end(), {nullptr, nullptr}, 0});
+            }
+            // The last point of the nearest non-empty shard to the left, and so on.
+            const point_type* previous = nullptr;
+            size_type previous_shard = 0;
+            for(size_type i = 0; i < shards.size(); i++) {
+                const shard_type& f = shards[i]->function;
+                if(f.size() == 0) continue;
+                const point_type& first = *f.begin();
+                if(previous != nullptr) {
+                    if(first.value() < previous->value()) exclude(i, first);
+                    if(previous->value() < first.value()) exclude(previous_shard, *previous);
+                }
+                previous = &*std::prev(f.end());
+                previous_shard = i;
             }
         }
-    }
 
-    // In some of the functions below, to_be_erased is the iterator to a point_type that
-    // is to be erased, either as a result of calling the 'erase' function or due to being
-    // overwritten by a new value for its argument.
+        void exclude(size_type i, const point_type& p) noexcept{
+            source& s = sources[i];
+            s.excluded[s.excluded_count++] = &p.arg();
+        }
 
-    // Returns the iterator to the point preceding p, skipping to_be_erased if necessary.
-    iterator multi_prev(const iterator p, const iterator to_be_erased) const{
-        return prev(p) == to_be_erased ? prev(prev(p)) : prev(p);
-    }
+        std::vector<std::unique_lock<std::mutex>> locks;
+        std::vector<source> sources;
 
-    iterator multi_next(const iterator p, const iterator previous) const{
-        if(p == points.end() || next(p) == points.end()) return points.end();
-        return next(p) == previous ? next(next(p)) : next(p);
-    }
+        friend class ConcurrentFunctionMaxima;
+    };
 
-    // Checks if p points to the first point of the function (or will point after
-    // to_be erased is erased).
-    bool multi_is_beginning(const iterator p, const iterator previous) const{
-        if(p == points.begin()) return true;
-        else if(prev(p) == previous && prev(p) == points.begin()) return true;
-        return false;
+    // Splits the domain at the given sorted boundaries into boundaries.size() + 1
+    // shards. The function is empty.
+    explicit ConcurrentFunctionMaxima(std::vector<A> boundaries_):
+    boundaries(std::move(boundaries_)),
+    shards()
+    {
+        shards.reserve(boundaries.size() + 1);
+        for(size_type i = 0; i <= boundaries.size(); i++) {
+            shards.push_back(std::make_unique<shard>());
+        }
     }
 
-    bool multi_is_ending(const iterator p, const iterator previous) const{
-        if(p == --points.end()) return true;
-        else if(next(p) == previous && next(p) == --points.end()) return true;
-        return false;
-    }
+    ConcurrentFunctionMaxima(const ConcurrentFunctionMaxima&) = delete;
+    ConcurrentFunctionMaxima& operator=(const ConcurrentFunctionMaxima&) = delete;
 
-    bool greater_than_next(const iterator p, const iterator previous) const{
-        if(multi_is_ending(p, previous)) return true;
-        if((*p).value() < (*(multi_next(p, previous))).value()) return false;
-        return true;
+    // Locks only the shard of a. This function has Strong Guarantee.
+    void set_value(A const& a, V const& v){
+        shard& s = shard_of(a);
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.function.set_value(a, v);
     }
 
-    bool greater_than_prev(const iterator p, const iterator previous) const{
-        if(multi_is_beginning(p, previous)) return true;
-        if((*p).value() < ((*(multi_prev(p, previous))).value())) return false;
-        return true;
+    // Locks only the shard of a. This function has Strong Guarantee.
+    void erase(A const& a){
+        shard& s = shard_of(a);
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.function.erase(a);
     }
 
+    // Returns a copy, as the point may be overwritten as soon as the lock is released.
     // This function has Strong Guarantee.
-    bool is_maximum(const iterator p, const iterator previous) const {
-        return greater_than_prev(p, previous) && greater_than_next(p, previous);
+    V value_at(A const& a) const{
+        shard& s = shard_of(a);
+        std::lock_guard<std::mutex> guard(s.lock);
+        return s.function.value_at(a);
     }
 
-    // This function has Strong Guarantee.
-    bool present_in_maxima_set(const point_type& p){
-        return maxima.find(p) != maxima.end();
+    size_type size() const{
+        auto locks = lock_all();
+        size_type result = 0;
+        for(const auto& s : shards) {
+            result += s->function.size();
+        }
+        return result;
     }
 
-    // Checks if 'it' points to a point that is a local maximum, and adds/removes
-    // it from the set of maxima accordingly. Strong Guarantee.
-    void conditional_add_new_maximum(const iterator it, int i, const iterator previous) {
-        if(it == points.end() || it == previous) return;
-        bool is_max = is_maximum(it, previous);
-        if (is_max) {
-            if (!present_in_maxima_set(*it)) {
-                to_rollback[i] = maxima.insert(*it).first;
-                if_rollback[i] = true;
-            }
-        }
-        else {
-            if (present_in_maxima_set(*it)) {
-                to_erase[i] = maxima.find(*it);
-                if_erase[i] = true;
-            }
-        }
+    size_type shard_count() const noexcept{
+        return shards.size();
     }
 
-    bool equivalent(V const& v1, V const& v2) const{
-        if(v1 < v2) return false;
-        if(v2 < v1) return false;
-        return true;
+    // See mx_view. Takes O(k) time for k shards, iterating takes O(log k) time per
+    // maximum. The shards are locked until the view is destroyed.
+    mx_view maxima() const{
+        return mx_view(*this);
     }
 
-    // This function has Strong Guarantee.
-    void custom_insert(A const& a, V const& v){
+};
 
-        iterator previous = points.find(a);
-        if(previous != points.end() && equivalent(v, (*previous).value())) return;
-        bool found = previous != points.end();
-        iterator it = points.insert(point_type(a, v));
+// A function with a single writer and any number of readers that never wait for it.
+// The writer modifies a private PersistentFunctionMaxima and publishes copies of it,
+// which takes O(1) time as the copies share their nodes. Readers pin the latest
+// published version through a hazard pointer of their own, kept in a separate cache
+// line, and the writer frees a replaced version once no reader has it pinned.
+// Readers that copy points need a policy whose counters are atomic.
+template<typename A, typename V, typename Policy = multi_threaded_t>
+class PublishedFunctionMaxima{
 
-        try {
+public:
 
-            conditional_add_new_maximum(it,1, previous);
-            conditional_add_new_maximum(multi_next(it, previous), 2, previous);
-            if(it != points.begin()) conditional_add_new_maximum(multi_prev(it, previous), 3, previous);
-            if(found) {
-                const point_type p = *previous;
-                auto temp = maxima.find(p);
-                if(temp != maxima.end()) {
-                    to_erase[4] = temp;
-                    if_erase[4] = true;
-                }
-                points.erase(previous);
-            }
+    using function_type = PersistentFunctionMaxima<A, V, Policy>;
 
-        }
-        catch(...) {
+private:
 
-            points.erase(it);
-            rollback_maxima();
-            clear_rollback();
-            clear_erase();
-            throw;
+    // Version pinned by a reader. Records are only added, and reused by new readers
+    // after theirs are gone.
+    struct alignas(64) hazard{
+        std::atomic<const function_type*> pinned{nullptr};
+        std::atomic<bool> active{true};
+        hazard* next = nullptr;
+    };
 
-        }
+    function_type draft;
+    std::atomic<const function_type*> current;
+    // Readers add their records through a const reference.
+    mutable std::atomic<hazard*> hazards;
+    // Replaced versions still pinned by some reader. Used only by the writer.
+    std::vector<const function_type*> retired;
 
-        erase_from_maxima();
-        clear_rollback();
-        clear_erase();
+    hazard* acquire_hazard() const{
+        for(hazard* h = hazards.load(std::memory_order_acquire); h != nullptr; h = h->next) {
+            bool expected = false;
+            if(h->active.compare_exchange_strong(expected, true)) return h;
+        }
+        hazard* h = new hazard();
+        h->next = hazards.load(std::memory_order_relaxed);
+        while(!hazards.compare_exchange_weak(h->next, h, std::memory_order_release, std::memory_order_relaxed)) {}
+        return h;
     }
 
-public:
-
-    using size_type = size_t;
-
-    void set_value(A const& a, V const& v){
-        custom_insert(a, v);
+    bool is_pinned(const function_type* version) const noexcept{
+        for(hazard* h = hazards.load(std::memory_order_acquire); h != nullptr; h = h->next) {
+            if(h->pinned.load(std::memory_order_relaxed) == version) return true;
+        }
+        return false;
     }
 
-    iterator begin() const noexcept{
-        return points.begin();
+    // Frees the retired versions no reader has pinned. No-throw.
+    void reclaim() noexcept{
+        // Pairs with the fence of reader::pin: a reader either sees the version that
+        // replaced its pinned one, or its hazard is seen here.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        size_t kept = 0;
+        for(const function_type* version : retired) {
+            if(is_pinned(version)) retired[kept++] = version;
+            else delete version;
+        }
+        retired.resize(kept);
     }
 
-    iterator end() const noexcept{
-        return points.end();
-    }
+public:
 
-    iterator find(A const& a) const{
-        return points.find(a);
-    }
+    // Pins published versions for a single reading thread.
+    class reader{
+    public:
+        // Strong Guarantee.
+        explicit reader(const PublishedFunctionMaxima& source):
+        source(source),
+        slot(source.acquire_hazard())
+        {}
 
-    mx_iterator mx_begin() const noexcept{
-        return maxima.begin();
-    }
+        reader(const reader&) = delete;
+        reader& operator=(const reader&) = delete;
 
-    mx_iterator mx_end() const noexcept{
-        return maxima.end();
-    }
+        ~reader(){
+            slot->pinned.store(nullptr, std::memory_order_release);
+            slot->active.store(false, std::memory_order_release);
+        }
 
-    void erase(A const& a){
-        auto it = points.find(a);
+        // The latest published version. It stays valid until pin or unpin is called
+        // again or the reader is destroyed. Lock-free.
+        const function_type& pin() noexcept{
+            const function_type* version = source.current.load(std::memory_order_acquire);
+            for(;;) {
+                slot->pinned.store(version, std::memory_order_relaxed);
+                // Orders the hazard before the check of current, see reclaim.
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                const function_type* latest = source.current.load(std::memory_order_acquire);
+                if(latest == version) return *version;
+                version = latest;
+            }
+        }
 
-        if(it != points.end()) {
-            auto p = *it;
+        void unpin() noexcept{
+            slot->pinned.store(nullptr, std::memory_order_release);
+        }
 
-            auto it2 = maxima.find(p);
-            try {
-                if (it2 != maxima.end()) {
-                    to_erase[0] = it2;
-                    if_erase[0] = true;
-                }
-                conditional_add_new_maximum(next(it), 2, it);
-                conditional_add_new_maximum(prev(it), 3, it);
+    private:
+        const PublishedFunctionMaxima& source;
+        hazard* slot;
+    };
 
-            } catch (...) {
-                rollback_maxima();
+    // Publishes an empty function.
+    PublishedFunctionMaxima():
+    draft(),
+    current(new function_type()),
+    hazards(nullptr),
+    retired()
+    {}
 
-                clear_rollback();
-                clear_erase();
-                throw;
-            }
+    PublishedFunctionMaxima(const PublishedFunctionMaxima&) = delete;
+    PublishedFunctionMaxima& operator=(const PublishedFunctionMaxima&) = delete;
 
-            erase_from_maxima();
-            points.erase(it);
-            clear_rollback();
-            clear_erase();
+    // No reader may be left.
+    ~PublishedFunctionMaxima(){
+        delete current.load();
+        for(const function_type* version : retired) {
+            delete version;
+        }
+        for(hazard* h = hazards.load(); h != nullptr;) {
+            hazard* next = h->next;
+            delete h;
+            h = next;
         }
     }
 
-    // This function is no - throw.
-    size_type size() const{
-        return points.size();
+    // The function modified by the writer, which readers do not see until it is
+    // published.
+    const function_type& unpublished() const noexcept{
+        return draft;
     }
 
+    // The functions below may only be called by the writer.
+
     // This function has Strong Guarantee.
-    V const& value_at(A const& a) const {
-        iterator res_it = points.find(a);
-        if(res_it == points.end()) {
-            throw InvalidArg();
-        }
-        V const& res = (*res_it).value();
-        return res;
+    void set_value(A const& a, V const& v){
+        draft.set_value(a, v);
     }
 
-    FunctionMaxima(): points(), maxima(), to_erase(), to_rollback(), if_erase(), if_rollback()
-    {
-        points = point_set();
-        maxima = maxima_set();
-        clear_erase();
-        clear_rollback();
+    // This function has Strong Guarantee.
+    void erase(A const& a){
+        draft.erase(a);
     }
 
+    // See PersistentFunctionMaxima::assign. Strong Guarantee.
+    template<typename Iterator>
+    void assign(Iterator first, Iterator last){
+        draft.assign(first, last);
+    }
 
-    FunctionMaxima(const FunctionMaxima<A, V> & rhs):
-    points(rhs.points),
-    maxima(rhs.maxima),
-    to_erase(),
-    to_rollback(),
-    if_erase(),
-    if_rollback()
-    {}
-
-    void swap(FunctionMaxima& rhs) noexcept{
-        std::swap(this->points, rhs.points);
-        std::swap(this->maxima, rhs.maxima);
-        std::swap(this->to_erase, rhs.to_erase);
-        std::swap(this->to_rollback, rhs.to_rollback);
-        std::swap(this->if_erase, rhs.if_erase);
-        std::swap(this->if_rollback, rhs.if_rollback);
+    template<typename Iterator>
+    void assign(Iterator first, Iterator last, size_t threads){
+        draft.assign(first, last, threads);
     }
 
-    FunctionMaxima& operator=(const FunctionMaxima<A, V> &rhs){
-        if(this == &rhs){
-            return *this;
-        }
-        FunctionMaxima temp(rhs);
-        temp.swap(*this);
-        return *this;
+    // Makes the modifications made so far visible to the readers pinning a version
+    // afterwards. Takes O(1) time apart from freeing the replaced versions.
+    // Strong Guarantee.
+    void publish(){
+        std::unique_ptr<const function_type> version(new function_type(draft));
+        function_maxima_detail::reserve_more(retired, 1);
+        retired.push_back(current.exchange(version.release()));
+        reclaim();
     }
 
 };
@@ -0,0 +1,500 @@
+#include "function_maxima.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A value that is not trivially copyable, so that the points of the function
+// are shared between the set of points and the set of maxima.
+class Reading {
+public:
+  explicit Reading(long v) : value(v) {
+  }
+  Reading(const Reading &other) : value(other.value) {
+  }
+  Reading &operator=(const Reading &other) {
+    value = other.value;
+    return *this;
+  }
+  bool operator<(const Reading &a) const {
+    return value < a.value;
+  }
+  long get() const {
+    return value;
+  }
+private:
+  long value;
+};
+
+template<typename Function>
+struct empty_function {
+  static Function make() {
+    return Function();
+  }
+};
+
+template<typename A, typename V, typename Policy>
+struct empty_function<DenseFunctionMaxima<A, V, Policy>> {
+  // Covers the arguments used by the loops below.
+  static DenseFunctionMaxima<A, V, Policy> make() {
+    return DenseFunctionMaxima<A, V, Policy>(0, 100001);
+  }
+};
+
+template<typename Function>
+double big_loop() {
+  auto start = std::chrono::steady_clock::now();
+
+  // The same loop as the one in maxima_example.cc.
+  Function big = empty_function<Function>::make();
+  using size_type = typename Function::size_type;
+  const size_type N = 100000;
+  for (size_type i = 1; i <= N; ++i) {
+    big.set_value(i, Reading(i));
+  }
+  size_type counter = 0;
+  for (size_type i = 1; i <= N; ++i) {
+    big.set_value(i, Reading(big.value_at(i).get() + 1));
+    for (auto it = big.mx_begin(); it != big.mx_end(); ++it) {
+      ++counter;
+    }
+  }
+  assert(counter == 2 * N - 1);
+
+  // Copies share the points, so they only touch the reference counters.
+  for (int i = 0; i < 10; ++i) {
+    Function copy(big);
+    assert(copy.size() == big.size());
+  }
+
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+using tree_function = FunctionMaxima<long, Reading, single_threaded_t>;
+
+tree_function sawtooth() {
+  tree_function fun;
+  for (long i = 0; i < 100000; ++i) {
+    fun.set_value(i, Reading(i % 7 * (i % 13)));
+  }
+  return fun;
+}
+
+// Read-only workload: lookups and iterations over a function built beforehand.
+template<typename Function>
+double query_loop() {
+  Function fun(sawtooth());
+
+  auto start = std::chrono::steady_clock::now();
+  long sum = 0;
+  for (long round = 0; round < 10; ++round) {
+    for (long i = 0; i < 100000; ++i) {
+      sum += fun.value_at((i * 7919) % 100000).get();
+    }
+    for (auto it = fun.begin(); it != fun.end(); ++it) {
+      sum += it->value().get();
+    }
+    for (auto it = fun.mx_begin(); it != fun.mx_end(); ++it) {
+      sum += it->arg();
+    }
+  }
+  assert(sum > 0);
+
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// A sorted series of (argument, value) pairs, generated once.
+const std::vector<std::pair<long, Reading>> &series() {
+  static std::vector<std::pair<long, Reading>> result = [] {
+    std::vector<std::pair<long, Reading>> pairs;
+    for (long i = 0; i < 1000000; ++i) {
+      pairs.emplace_back(i, Reading(i % 7 * (i % 13)));
+    }
+    return pairs;
+  }();
+  return result;
+}
+
+// Loads the series one point at a time.
+template<typename Function>
+double load_by_set_value() {
+  const auto &pairs = series();
+  auto start = std::chrono::steady_clock::now();
+  Function fun;
+  for (const auto &p : pairs) {
+    fun.set_value(p.first, p.second);
+  }
+  assert(fun.size() == pairs.size());
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Loads the series with a single bulk construction.
+template<typename Function>
+double load_by_assign() {
+  const auto &pairs = series();
+  auto start = std::chrono::steady_clock::now();
+  Function fun(pairs.begin(), pairs.end());
+  assert(fun.size() == pairs.size());
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Loads the series with a bulk construction whose maxima are found and sorted by
+// all the available threads.
+template<typename Function>
+double load_by_parallel_assign() {
+  const auto &pairs = series();
+  auto start = std::chrono::steady_clock::now();
+  Function fun;
+  fun.assign(pairs.begin(), pairs.end(),
+             std::max(1u, std::thread::hardware_concurrency()));
+  assert(fun.size() == pairs.size());
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Overwrites every point of a function built beforehand, ten times over.
+template<typename Function>
+double overwrite_loop() {
+  Function fun;
+  for (long i = 0; i < 100000; ++i) {
+    fun.set_value(i, Reading(i % 7 * (i % 13)));
+  }
+  auto start = std::chrono::steady_clock::now();
+  for (long round = 1; round <= 10; ++round) {
+    for (long i = 0; i < 100000; ++i) {
+      fun.set_value(i, Reading((i + round) % 7 * (i % 13)));
+    }
+  }
+  assert(fun.size() == 100000);
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Builds a FlatFunctionMaxima from the series with values of type Value. For
+// plain numbers the local maxima are found by the vectorized kernel.
+template<typename Value>
+double extrema_kernel_loop() {
+  std::vector<std::pair<long, Value>> pairs;
+  for (const auto &p : series()) {
+    pairs.emplace_back(p.first, Value(p.second.get()));
+  }
+  auto start = std::chrono::steady_clock::now();
+  FlatFunctionMaxima<long, Value, single_threaded_t> fun(pairs.begin(), pairs.end());
+  assert(fun.size() == pairs.size());
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Overwrites every other point of a function built beforehand, in batches of 1000.
+template<typename Function, bool Batched>
+double update_loop() {
+  Function fun(sawtooth());
+  std::vector<std::pair<long, Reading>> batch;
+  for (long i = 0; i < 100000; i += 2) {
+    batch.emplace_back(i, Reading(i % 11));
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t from = 0; from < batch.size(); from += 1000) {
+    auto first = batch.begin() + from;
+    auto last = batch.begin() + std::min(from + 1000, batch.size());
+    if constexpr (Batched) {
+      fun.set_values(first, last);
+    } else {
+      for (auto it = first; it != last; ++it) {
+        fun.set_value(it->first, it->second);
+      }
+    }
+  }
+  assert(fun.value_at(50).get() == 50 % 11);
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Drops the points of a function built beforehand in runs of 1000 arguments,
+// the way a retention job drops old timestamps.
+template<typename Function, bool Ranged>
+double retention_loop() {
+  Function fun(sawtooth());
+
+  auto start = std::chrono::steady_clock::now();
+  for (long from = 0; from < 100000; from += 1000) {
+    if constexpr (Ranged) {
+      fun.erase_range(from, from + 1000);
+    } else {
+      for (long i = from; i < from + 1000; ++i) {
+        fun.erase(i);
+      }
+    }
+  }
+  assert(fun.size() == 0);
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Finds the local maxima in windows of 1000 arguments, by walking all the maxima
+// or through the index of maxima ordered by arguments.
+template<bool Indexed>
+double window_loop() {
+  using Function = FunctionMaxima<long, Reading, maxima_by_argument_t<single_threaded_t>>;
+  Function fun;
+  fun.assign(series().begin(), series().begin() + 100000);
+
+  auto start = std::chrono::steady_clock::now();
+  long sum = 0;
+  for (long lo = 0; lo < 100000; lo += 100) {
+    long hi = lo + 999;
+    if constexpr (Indexed) {
+      for (const auto &p : fun.maxima_in(lo, hi)) {
+        sum += p.arg();
+      }
+    } else {
+      for (auto it = fun.mx_begin(); it != fun.mx_end(); ++it) {
+        if (lo <= it->arg() && it->arg() <= hi) {
+          sum += it->arg();
+        }
+      }
+    }
+  }
+  assert(sum > 0);
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Finds the highest value in windows of 1000 arguments, by walking the points of
+// the window or through the range maximum index.
+template<bool Indexed>
+double range_max_loop() {
+  using Function = FunctionMaxima<long, Reading, range_max_t<single_threaded_t>>;
+  Function fun;
+  fun.assign(series().begin(), series().begin() + 100000);
+
+  auto start = std::chrono::steady_clock::now();
+  long sum = 0;
+  for (long lo = 0; lo < 100000; lo += 100) {
+    long hi = lo + 999;
+    if constexpr (Indexed) {
+      sum += fun.max_in_range(lo, hi).value().get();
+    } else {
+      long best = 0;
+      for (auto it = fun.find(lo); it != fun.end() && it->arg() <= hi; ++it) {
+        best = std::max(best, it->value().get());
+      }
+      sum += best;
+    }
+  }
+  assert(sum > 0);
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Tracks both the peaks and the troughs of a series, with a second function fed
+// negated values or with a single function keeping the minima too.
+template<bool Tracked>
+double extrema_loop() {
+  auto start = std::chrono::steady_clock::now();
+  FunctionMaxima<long, Reading, track_minima_t<single_threaded_t>> both;
+  tree_function peaks;
+  tree_function troughs;
+  for (long i = 0; i < 100000; ++i) {
+    long value = (i * 7919) % 1000;
+    if constexpr (Tracked) {
+      both.set_value(i % 20000, Reading(value));
+    } else {
+      peaks.set_value(i % 20000, Reading(value));
+      troughs.set_value(i % 20000, Reading(-value));
+    }
+  }
+  if constexpr (Tracked) {
+    assert(both.mn_begin() != both.mn_end());
+  } else {
+    assert(troughs.mx_begin() != troughs.mx_end());
+  }
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Keeps a copy of a function for every epoch of 100 updates, the way queries are
+// served from a snapshot taken at the start of their epoch.
+template<typename Function>
+double snapshot_loop() {
+  Function fun(sawtooth());
+  std::vector<Function> epochs;
+
+  auto start = std::chrono::steady_clock::now();
+  for (long epoch = 0; epoch < 200; ++epoch) {
+    epochs.push_back(fun);
+    for (long i = 0; i < 100; ++i) {
+      long a = (epoch * 100 + i) * 7919 % 100000;
+      fun.set_value(a, Reading(epoch % 17));
+    }
+  }
+  assert(epochs.front().value_at(7919).get() == 7919 % 7 * (7919 % 13));
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Applies batches of 100 updates that are all reverted, by restoring a copy taken
+// beforehand or by rolling back a transaction.
+template<bool Transactional>
+double revert_loop() {
+  tree_function fun(sawtooth());
+
+  auto start = std::chrono::steady_clock::now();
+  for (long round = 0; round < 100; ++round) {
+    tree_function backup;
+    if constexpr (Transactional) {
+      fun.begin_transaction();
+    } else {
+      backup = fun;
+    }
+    for (long i = 0; i < 100; ++i) {
+      fun.set_value((round * 100 + i) * 7919 % 100000, Reading(round % 17));
+    }
+    if constexpr (Transactional) {
+      fun.rollback();
+    } else {
+      fun.swap(backup);
+    }
+  }
+  assert(fun.value_at(7919).get() == 7919 % 7 * (7919 % 13));
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Ingests 400000 points from 4 threads, each of them writing its own quarter of
+// the arguments, behind a single mutex or into the shards of one function.
+template<bool Sharded>
+double ingest_loop() {
+  const long per_thread = 100000;
+  std::mutex lock;
+  FunctionMaxima<long, Reading> whole;
+  ConcurrentFunctionMaxima<long, Reading> sharded({per_thread, 2 * per_thread, 3 * per_thread});
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (long t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t] {
+      for (long i = t * per_thread; i < (t + 1) * per_thread; ++i) {
+        if constexpr (Sharded) {
+          sharded.set_value(i, Reading(i % 7 * (i % 13)));
+        } else {
+          std::lock_guard<std::mutex> guard(lock);
+          whole.set_value(i, Reading(i % 7 * (i % 13)));
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  assert((Sharded ? sharded.size() : whole.size()) == 4 * per_thread);
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+void report(const std::string &name, double (*benchmark)()) {
+  std::cout << name << ": " << benchmark() << " ms" << std::endl;
+}
+
+int main() {
+  using multi = FunctionMaxima<long, Reading>;
+  using single = FunctionMaxima<long, Reading, single_threaded_t>;
+  using btree = FunctionMaxima<long, Reading, btree_t<single_threaded_t>>;
+  using dense = DenseFunctionMaxima<long, Reading, single_threaded_t>;
+  using persistent = PersistentFunctionMaxima<long, Reading, single_threaded_t>;
+
+  std::cout << "big loop" << std::endl;
+  report("  multi_threaded_t", big_loop<multi>);
+  report("  single_threaded_t", big_loop<single>);
+  report("  btree_t<single_threaded_t>", big_loop<btree>);
+  report("  DenseFunctionMaxima", big_loop<dense>);
+  report("  range_max_t<single_threaded_t>",
+         big_loop<FunctionMaxima<long, Reading, range_max_t<single_threaded_t>>>);
+  report("  PersistentFunctionMaxima", big_loop<persistent>);
+
+  std::cout << "loading a sorted series" << std::endl;
+  report("  set_value", load_by_set_value<tree_function>);
+  report("  bulk construction", load_by_assign<tree_function>);
+  report("  set_value, btree_t", load_by_set_value<btree>);
+  report("  bulk construction, btree_t", load_by_assign<btree>);
+  report("  parallel assign", load_by_parallel_assign<tree_function>);
+  report("  parallel assign, FlatFunctionMaxima",
+         load_by_parallel_assign<FlatFunctionMaxima<long, Reading, single_threaded_t>>);
+
+  using flat = FlatFunctionMaxima<long, Reading, single_threaded_t>;
+
+  std::cout << "finding the local maxima of a series" << std::endl;
+  report("  Reading values", extrema_kernel_loop<Reading>);
+  report("  long values", extrema_kernel_loop<long>);
+
+  std::cout << "overwriting every point" << std::endl;
+  report("  FunctionMaxima", overwrite_loop<tree_function>);
+  report("  btree_t", overwrite_loop<btree>);
+
+  std::cout << "batched updates" << std::endl;
+  report("  set_value", update_loop<tree_function, false>);
+  report("  set_values", update_loop<tree_function, true>);
+  report("  set_value, FlatFunctionMaxima", update_loop<flat, false>);
+  report("  set_values, FlatFunctionMaxima", update_loop<flat, true>);
+
+  std::cout << "dropping runs of arguments" << std::endl;
+  report("  erase", retention_loop<tree_function, false>);
+  report("  erase_range", retention_loop<tree_function, true>);
+  report("  erase, FlatFunctionMaxima", retention_loop<flat, false>);
+  report("  erase_range, FlatFunctionMaxima", retention_loop<flat, true>);
+
+  std::cout << "maxima in windows of arguments" << std::endl;
+  report("  walking mx_begin..mx_end", window_loop<false>);
+  report("  maxima_in", window_loop<true>);
+
+  std::cout << "highest value in windows of arguments" << std::endl;
+  report("  walking the points", range_max_loop<false>);
+  report("  max_in_range", range_max_loop<true>);
+
+  std::cout << "peaks and troughs" << std::endl;
+  report("  two functions", extrema_loop<false>);
+  report("  track_minima_t", extrema_loop<true>);
+
+  std::cout << "a snapshot per epoch" << std::endl;
+  report("  FunctionMaxima", snapshot_loop<tree_function>);
+  report("  PersistentFunctionMaxima", snapshot_loop<persistent>);
+
+  std::cout << "reverting batches" << std::endl;
+  report("  restoring a copy", revert_loop<false>);
+  report("  rollback", revert_loop<true>);
+
+  std::cout << "ingesting from 4 threads" << std::endl;
+  report("  one mutex", ingest_loop<false>);
+  report("  ConcurrentFunctionMaxima", ingest_loop<true>);
+
+  std::cout << "queries" << std::endl;
+  report("  FunctionMaxima", query_loop<tree_function>);
+  report("  FlatFunctionMaxima", query_loop<flat>);
+  report("  PersistentFunctionMaxima", query_loop<persistent>);
+}
@@ -0,0 +1,1503 @@
+// Randomised tests of the functions against a std::map of the same points. Faults
+// are injected into the comparisons and copies of arguments and values and into the
+// allocations, and every operation that fails must leave the function as it was.
+// Build and run with
+//   g++ -std=c++17 -O2 maxima_test.cc -pthread && ./a.out
+// The program exits with 1 if any test fails.
+
+#include "function_maxima.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <map>
+#include <memory>
+#include <new>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Faults are injected by counting down: the operation that brings a counter to zero
+// throws, a counter that is not positive never does.
+thread_local long operations_left = 0;
+thread_local long allocations_left = 0;
+
+struct injected_fault {};
+
+void tick() {
+  if (operations_left > 0 && --operations_left == 0) {
+    throw injected_fault();
+  }
+}
+
+// An int whose copies and comparisons may fail.
+class Number {
+public:
+  Number(int v) : v(v) {
+  }
+  Number(const Number &n) : v(n.v) {
+    tick();
+  }
+  Number &operator=(const Number &n) {
+    tick();
+    v = n.v;
+    return *this;
+  }
+  bool operator<(const Number &n) const {
+    tick();
+    return v < n.v;
+  }
+  int get() const {
+    return v;
+  }
+private:
+  int v;
+};
+
+// Copies of Tracked made so far.
+thread_local long copies = 0;
+
+// An int whose construction and comparisons may fail, counting its copies. Moving
+// it never fails and is not counted.
+class Tracked {
+public:
+  explicit Tracked(int v) : v(v) {
+    tick();
+  }
+  Tracked(const Tracked &t) : v(t.v) {
+    ++copies;
+  }
+  Tracked(Tracked &&t) noexcept : v(t.v) {
+  }
+  Tracked &operator=(const Tracked &t) {
+    ++copies;
+    v = t.v;
+    return *this;
+  }
+  Tracked &operator=(Tracked &&t) noexcept {
+    v = t.v;
+    return *this;
+  }
+  bool operator<(const Tracked &t) const {
+    tick();
+    return v < t.v;
+  }
+  int get() const {
+    return v;
+  }
+private:
+  int v;
+};
+
+// Objects allocated through the policies of the tests, which must all be freed
+// again by the end of every test.
+thread_local long live_objects = 0;
+
+// Allocator of a policy, counting the objects it allocates.
+template<typename T>
+struct counting_allocator {
+  using value_type = T;
+
+  counting_allocator() noexcept = default;
+
+  template<typename U>
+  counting_allocator(const counting_allocator<U> &) noexcept {
+  }
+
+  T *allocate(std::size_t n) {
+    T *p = std::allocator<T>().allocate(n);
+    live_objects += static_cast<long>(n);
+    return p;
+  }
+
+  void deallocate(T *p, std::size_t n) noexcept {
+    live_objects -= static_cast<long>(n);
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  friend bool operator==(const counting_allocator &, const counting_allocator &) noexcept {
+    return true;
+  }
+
+  friend bool operator!=(const counting_allocator &, const counting_allocator &) noexcept {
+    return false;
+  }
+};
+
+template<typename Base = multi_threaded_t>
+struct counted_t : Base {
+  template<typename T>
+  using allocator = counting_allocator<T>;
+};
+
+} // namespace
+
+// Not inlined, so that the compiler does not match the calls of malloc and free
+// with new and delete expressions.
+[[gnu::noinline]] void *operator new(std::size_t size) {
+  if (allocations_left > 0 && --allocations_left == 0) {
+    throw std::bad_alloc();
+  }
+  if (void *p = std::malloc(size == 0 ? 1 : size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+// The nothrow version is replaced as well, as it need not call the other one.
+[[gnu::noinline]] void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  if (allocations_left > 0 && --allocations_left == 0) {
+    return nullptr;
+  }
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+[[gnu::noinline]] void operator delete(void *p) noexcept {
+  std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, std::size_t) noexcept {
+  std::free(p);
+}
+
+namespace {
+
+struct test_failure {};
+
+#define CHECK(condition)                                                     \
+  do {                                                                       \
+    if (!(condition)) {                                                      \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+                   #condition);                                              \
+      throw test_failure();                                                  \
+    }                                                                        \
+  } while (0)
+
+int failures = 0;
+
+template<typename Test>
+void run(const char *name, unsigned seed, Test test) {
+  try {
+    test(seed);
+  } catch (test_failure &) {
+    std::fprintf(stderr, "%s, seed %u: failed\n", name, seed);
+    ++failures;
+  }
+  if (live_objects != 0) {
+    std::fprintf(stderr, "%s, seed %u: %ld objects leaked\n", name, seed, live_objects);
+    ++failures;
+    live_objects = 0;
+  }
+  operations_left = 0;
+  allocations_left = 0;
+}
+
+enum class fault { none, operations, allocations };
+
+// Arms the counter of the given faults at a random operation, among the first
+// 4 * spread comparisons or copies or the first spread allocations.
+void arm(fault faults, std::mt19937 &rng, int spread = 6) {
+  if (faults == fault::operations) {
+    operations_left = 1 + rng() % (4 * spread);
+  } else if (faults == fault::allocations) {
+    allocations_left = 1 + rng() % spread;
+  }
+}
+
+void disarm() {
+  operations_left = 0;
+  allocations_left = 0;
+}
+
+// Disarms the faults for a scope, restoring them afterwards.
+class unarmed {
+public:
+  unarmed() : operations(operations_left), allocations(allocations_left) {
+    disarm();
+  }
+  ~unarmed() {
+    operations_left = operations;
+    allocations_left = allocations;
+  }
+private:
+  long operations;
+  long allocations;
+};
+
+// Arguments and values of the tests are ints, converted to and from the types
+// of the functions. Strings are padded, so that they are ordered like the ints.
+template<typename T>
+T make(int x) {
+  return T(x);
+}
+
+template<>
+std::string make<std::string>(int x) {
+  char buffer[16];
+  std::snprintf(buffer, sizeof buffer, "%06d", x);
+  return buffer;
+}
+
+int to_int(int x) {
+  return x;
+}
+
+int to_int(long x) {
+  return static_cast<int>(x);
+}
+
+int to_int(double x) {
+  return static_cast<int>(x);
+}
+
+int to_int(const Number &x) {
+  return x.get();
+}
+
+int to_int(const Tracked &x) {
+  return x.get();
+}
+
+int to_int(const std::string &x) {
+  return std::stoi(x);
+}
+
+using model = std::map<int, int>;
+
+template<typename F>
+using arg_of = typename std::decay<decltype(std::declval<typename F::point_type>().arg())>::type;
+
+template<typename F>
+using value_of = typename std::decay<decltype(std::declval<typename F::point_type>().value())>::type;
+
+template<typename F>
+using pairs_of = std::vector<std::pair<arg_of<F>, value_of<F>>>;
+
+// Local maxima of the model, in the order of mx_begin.
+std::vector<std::pair<int, int>> maxima_of(const model &m) {
+  std::vector<std::pair<int, int>> result;
+  for (auto it = m.begin(); it != m.end(); ++it) {
+    if ((it == m.begin() || !(it->second < std::prev(it)->second)) &&
+        (std::next(it) == m.end() || !(it->second < std::next(it)->second))) {
+      result.push_back(*it);
+    }
+  }
+  std::sort(result.begin(), result.end(), [](const auto &l, const auto &r) {
+    return l.second != r.second ? l.second > r.second : l.first < r.first;
+  });
+  return result;
+}
+
+// Local minima of the model, in the order of mn_begin.
+std::vector<std::pair<int, int>> minima_of(const model &m) {
+  std::vector<std::pair<int, int>> result;
+  for (auto it = m.begin(); it != m.end(); ++it) {
+    if ((it == m.begin() || !(std::prev(it)->second < it->second)) &&
+        (std::next(it) == m.end() || !(std::next(it)->second < it->second))) {
+      result.push_back(*it);
+    }
+  }
+  std::sort(result.begin(), result.end(), [](const auto &l, const auto &r) {
+    return l.second != r.second ? l.second < r.second : l.first < r.first;
+  });
+  return result;
+}
+
+template<typename Point>
+bool same(const Point &p, const std::pair<int, int> &q) {
+  return to_int(p.arg()) == q.first && to_int(p.value()) == q.second;
+}
+
+template<typename Iterator>
+void check_sequence(Iterator first, Iterator last,
+                    const std::vector<std::pair<int, int>> &expected) {
+  std::size_t i = 0;
+  for (; first != last; ++first, ++i) {
+    CHECK(i < expected.size() && same(*first, expected[i]));
+  }
+  CHECK(i == expected.size());
+}
+
+// Checks what only some variants and policies offer.
+template<typename F>
+void check_extras(const F &, const model &) {
+}
+
+template<typename A, typename V, typename P>
+void check_extras(const FunctionMaxima<A, V, P> &f, const model &m) {
+  if constexpr (P::track_minima) {
+    check_sequence(f.mn_begin(), f.mn_end(), minima_of(m));
+  } else {
+    CHECK(f.mn_begin() == f.mn_end());
+  }
+  if constexpr (P::maxima_by_argument) {
+    std::vector<std::pair<int, int>> maxima = maxima_of(m);
+    std::sort(maxima.begin(), maxima.end());
+    for (int lo = -2; lo < 50; lo += 3) {
+      for (int hi = lo - 2; hi < lo + 12; hi += 3) {
+        std::vector<std::pair<int, int>> expected;
+        for (const auto &p : maxima) {
+          if (lo <= p.first && p.first <= hi) expected.push_back(p);
+        }
+        auto view = f.maxima_in(make<A>(lo), make<A>(hi));
+        CHECK(view.size() == expected.size());
+        check_sequence(view.begin(), view.end(), expected);
+      }
+    }
+  }
+  if constexpr (P::range_max) {
+    for (int lo = -2; lo < 50; lo += 3) {
+      for (int hi = lo - 1; hi < lo + 20; hi += 4) {
+        auto first = m.lower_bound(lo);
+        auto last = hi < lo ? first : m.upper_bound(hi);
+        auto best = first;
+        for (auto it = first; it != last; ++it) {
+          if (best->second < it->second) best = it;
+        }
+        if (first == last) {
+          bool thrown = false;
+          try {
+            f.max_in_range(make<A>(lo), make<A>(hi));
+          } catch (InvalidArg &) {
+            thrown = true;
+          }
+          CHECK(thrown);
+        } else {
+          CHECK(same(f.max_in_range(make<A>(lo), make<A>(hi)), *best));
+        }
+      }
+    }
+  }
+}
+
+// Compares the function with the model.
+template<typename F>
+void check(const F &f, const model &m) {
+  unarmed guard;
+  CHECK(f.size() == m.size());
+  check_sequence(f.begin(), f.end(), std::vector<std::pair<int, int>>(m.begin(), m.end()));
+  auto reverse = m.rbegin();
+  for (auto it = f.end(); it != f.begin(); ++reverse) {
+    --it;
+    CHECK(same(*it, *reverse));
+  }
+  for (const auto &p : m) {
+    CHECK(to_int(f.value_at(make<arg_of<F>>(p.first))) == p.second);
+    CHECK(f.find(make<arg_of<F>>(p.first)) != f.end());
+  }
+
+  std::vector<std::pair<int, int>> maxima = maxima_of(m);
+  check_sequence(f.mx_begin(), f.mx_end(), maxima);
+  if (maxima.empty()) {
+    bool thrown = false;
+    try {
+      f.global_max();
+    } catch (InvalidArg &) {
+      thrown = true;
+    }
+    CHECK(thrown);
+  } else {
+    CHECK(same(f.global_max(), maxima[0]) && &f.top() == &f.global_max());
+  }
+  for (std::size_t k : {0, 1, 3, 1000}) {
+    auto view = f.top_k(k);
+    std::size_t count = std::min(k, maxima.size());
+    CHECK(view.size() == count);
+    check_sequence(view.begin(), view.end(),
+                   std::vector<std::pair<int, int>>(maxima.begin(), maxima.begin() + count));
+  }
+  check_extras(f, m);
+}
+
+template<typename F, typename = void>
+struct has_erase_range : std::false_type {};
+
+template<typename F>
+struct has_erase_range<F, std::void_t<decltype(std::declval<F &>().erase_range(
+    std::declval<arg_of<F>>(), std::declval<arg_of<F>>()))>> : std::true_type {};
+
+template<typename F, typename = void>
+struct has_assign : std::false_type {};
+
+template<typename F>
+struct has_assign<F, std::void_t<decltype(std::declval<F &>().assign(
+    std::declval<typename pairs_of<F>::iterator>(),
+    std::declval<typename pairs_of<F>::iterator>()))>> : std::true_type {};
+
+template<typename F>
+struct factory {
+  static F make(int) {
+    return F();
+  }
+};
+
+template<typename A, typename V, typename P>
+struct factory<DenseFunctionMaxima<A, V, P>> {
+  static DenseFunctionMaxima<A, V, P> make(int range) {
+    return DenseFunctionMaxima<A, V, P>(-3, range + 8);
+  }
+};
+
+// Sorted pairs with arguments from [0, range), and their model.
+template<typename F>
+pairs_of<F> random_pairs(std::mt19937 &rng, int count, int range, model &m) {
+  pairs_of<F> result;
+  int a = 0;
+  for (int i = 0; i < count && a < range; i++) {
+    int v = rng() % 5;
+    result.emplace_back(make<arg_of<F>>(a), make<value_of<F>>(v));
+    m[a] = v;
+    a += rng() % 3;
+  }
+  return result;
+}
+
+// Applies random operations with arguments from [0, range) and compares the
+// function with the model after every one of them. An operation that fails with
+// an injected fault must leave the function unchanged. The operations alternate
+// between phases of mostly setting and mostly erasing points, so that the nodes of
+// the trees are split as well as merged.
+template<typename F>
+void random_operations(unsigned seed, int operations, int range, fault faults) {
+  using A = arg_of<F>;
+  using V = value_of<F>;
+  std::mt19937 rng(seed);
+  F f = factory<F>::make(range);
+  model m;
+  for (int i = 0; i < operations; i++) {
+    bool filling = i / 500 % 2 == 0;
+    int op = rng() % 20;
+    int a = rng() % range;
+    int v = rng() % 5;
+    int b = a + static_cast<int>(rng() % 8) - 1;
+    A key = make<A>(a);
+    A bound = make<A>(b);
+    V value = make<V>(v);
+    pairs_of<F> pairs;
+    model expected = m;
+    if (op < (filling ? 14 : 6)) {
+      expected[a] = v;
+    } else if (op < 17) {
+      expected.erase(a);
+    } else if (op < 19) {
+      if (has_erase_range<F>::value) {
+        expected.erase(expected.lower_bound(a), expected.lower_bound(std::max(a, b)));
+      }
+    } else if (has_assign<F>::value) {
+      expected.clear();
+      pairs = random_pairs<F>(rng, rng() % 40, range, expected);
+    }
+
+    // The model is updated beforehand, as it allocates too.
+    arm(faults, rng);
+    try {
+      if (op < (filling ? 14 : 6)) {
+        f.set_value(key, value);
+      } else if (op < 17) {
+        f.erase(key);
+      } else if (op < 19) {
+        if constexpr (has_erase_range<F>::value) {
+          f.erase_range(key, bound);
+        }
+      } else if constexpr (has_assign<F>::value) {
+        f.assign(pairs.begin(), pairs.end());
+      }
+      disarm();
+      m = std::move(expected);
+    } catch (injected_fault &) {
+      CHECK(faults == fault::operations);
+    } catch (std::bad_alloc &) {
+      CHECK(faults == fault::allocations);
+    }
+    disarm();
+    check(f, m);
+
+    if (i % 100 == 0) {
+      F copy(f);
+      check(copy, m);
+      F assigned = factory<F>::make(range);
+      assigned = copy;
+      check(assigned, m);
+    }
+  }
+}
+
+// Runs a test without faults and with every kind of faults the types can inject.
+template<typename F, typename Test>
+void with_faults(const char *name, Test test) {
+  for (unsigned seed = 1; seed <= 4; seed++) {
+    run(name, seed, [&](unsigned s) { test(s, fault::none); });
+    run(name, seed, [&](unsigned s) { test(s, fault::allocations); });
+    if constexpr (std::is_same<arg_of<F>, Number>::value) {
+      run(name, seed, [&](unsigned s) { test(s, fault::operations); });
+    }
+  }
+}
+
+template<typename F>
+void random_operations(const char *name, int operations, int range) {
+  with_faults<F>(name, [=](unsigned seed, fault faults) {
+    random_operations<F>(seed, operations, range, faults);
+  });
+}
+
+// Sets random batches of values, which may repeat arguments, with set_values and
+// erases single points between them. A batch that fails must leave the function
+// unchanged as a whole.
+template<typename F>
+void random_batches(unsigned seed, int range, fault faults) {
+  std::mt19937 rng(seed);
+  F f;
+  model m;
+  for (int i = 0; i < 400; i++) {
+    if (rng() % 4 == 0) {
+      int a = rng() % range;
+      f.erase(make<arg_of<F>>(a));
+      m.erase(a);
+    }
+    pairs_of<F> batch;
+    model expected = m;
+    int size = rng() % (i % 10 == 0 ? 60 : 8);
+    for (int j = 0; j < size; j++) {
+      int a = rng() % range;
+      int v = rng() % 5;
+      batch.emplace_back(make<arg_of<F>>(a), make<value_of<F>>(v));
+      expected[a] = v;
+    }
+
+    arm(faults, rng, 3 * size + 6);
+    try {
+      f.set_values(batch.begin(), batch.end());
+      disarm();
+      m = std::move(expected);
+    } catch (injected_fault &) {
+      CHECK(faults == fault::operations);
+    } catch (std::bad_alloc &) {
+      CHECK(faults == fault::allocations);
+    }
+    disarm();
+    check(f, m);
+  }
+}
+
+template<typename F>
+void random_batches(const char *name, int range) {
+  with_faults<F>(name, [=](unsigned seed, fault faults) {
+    random_batches<F>(seed, range, faults);
+  });
+}
+
+// Takes snapshots of a persistent function between random operations, and checks
+// that every snapshot keeps the points and maxima it was taken with, also after the
+// function is destroyed. A snapshot copied afterwards can be modified on its own.
+template<typename F>
+void random_snapshots(unsigned seed, fault faults) {
+  using A = arg_of<F>;
+  using V = value_of<F>;
+  std::mt19937 rng(seed);
+  std::unique_ptr<F> f(new F());
+  model m;
+  std::vector<std::pair<typename F::snapshot_type, model>> snapshots;
+  for (int i = 0; i < 600; i++) {
+    int a = rng() % 30;
+    int v = rng() % 5;
+    bool setting = rng() % 3 != 0;
+    arm(faults, rng);
+    try {
+      if (setting) {
+        f->set_value(make<A>(a), make<V>(v));
+      } else {
+        f->erase(make<A>(a));
+      }
+      disarm();
+      if (setting) {
+        m[a] = v;
+      } else {
+        m.erase(a);
+      }
+    } catch (injected_fault &) {
+      CHECK(faults == fault::operations);
+    } catch (std::bad_alloc &) {
+      CHECK(faults == fault::allocations);
+    }
+    disarm();
+    if (i % 40 == 0) {
+      arm(faults, rng);
+      try {
+        snapshots.emplace_back(f->snapshot(), m);
+      } catch (std::bad_alloc &) {
+        CHECK(faults == fault::allocations);
+      }
+      disarm();
+    }
+    check(*f, m);
+    for (const auto &snapshot : snapshots) {
+      check(*snapshot.first, snapshot.second);
+    }
+  }
+
+  f.reset();
+  for (const auto &snapshot : snapshots) {
+    check(*snapshot.first, snapshot.second);
+    F copy(*snapshot.first);
+    model changed = snapshot.second;
+    for (int j = 0; j < 20; j++) {
+      int a = rng() % 30;
+      int v = rng() % 5;
+      copy.set_value(make<A>(a), make<V>(v));
+      changed[a] = v;
+    }
+    check(copy, changed);
+    check(*snapshot.first, snapshot.second);
+  }
+}
+
+// Walks from points found in a function deep enough for the iterators to lose
+// sight of the ancestors of the points, and from the end, in both directions.
+template<typename F>
+void random_walks(unsigned seed) {
+  using A = arg_of<F>;
+  std::mt19937 rng(seed);
+  model m;
+  pairs_of<F> pairs = random_pairs<F>(rng, 5000, 5000, m);
+  F f(pairs.begin(), pairs.end());
+  check(f, m);
+  for (int i = 0; i < 2000; i++) {
+    auto expected = i % 10 == 0 ? m.end() : m.lower_bound(rng() % 5000);
+    auto it = expected == m.end() ? f.end() : f.find(make<A>(expected->first));
+    int steps = rng() % 40;
+    for (int j = 0; j < steps; j++) {
+      bool forwards = rng() % 2 == 0 && expected != m.end();
+      if (!forwards && expected == m.begin()) break;
+      if (forwards) {
+        ++expected;
+        ++it;
+      } else {
+        --expected;
+        --it;
+      }
+      if (expected == m.end()) {
+        CHECK(it == f.end());
+      } else {
+        CHECK(it != f.end() && same(*it, *expected));
+      }
+    }
+  }
+}
+
+// Assigns sorted pairs with repeated arguments with the given numbers of threads,
+// including none and more threads than pairs, and compares the function with the
+// model, as assign with a single thread and without threads are. Large inputs are
+// split between several threads. A failed assign must leave the function as it was.
+template<typename F>
+void parallel_assign(unsigned seed, fault faults) {
+  using A = arg_of<F>;
+  using V = value_of<F>;
+  std::mt19937 rng(seed);
+  for (int n : {0, 1, 2, 3, 7, 100, 9000, 20000}) {
+    for (std::size_t threads : {std::size_t(0), std::size_t(1), std::size_t(2), std::size_t(3),
+                                std::size_t(7), std::size_t(n + 3)}) {
+      F f;
+      model m;
+      for (int j = rng() % 10; j > 0; j--) {
+        int a = rng() % 40;
+        int v = rng() % 5;
+        f.set_value(make<A>(a), make<V>(v));
+        m[a] = v;
+      }
+      pairs_of<F> pairs;
+      model assigned;
+      for (int j = 0, a = 0; j < n; j++) {
+        int v = rng() % 5;
+        pairs.emplace_back(make<A>(a), make<V>(v));
+        assigned[a] = v;
+        a += rng() % 3;
+      }
+
+      arm(faults, rng, n / 4 + 6);
+      try {
+        f.assign(pairs.begin(), pairs.end(), threads);
+        disarm();
+        m = assigned;
+      } catch (injected_fault &) {
+        CHECK(faults == fault::operations);
+      } catch (std::bad_alloc &) {
+        CHECK(faults == fault::allocations);
+      }
+      disarm();
+      check(f, m);
+
+      if (threads == 0) {
+        F serial;
+        serial.assign(pairs.begin(), pairs.end());
+        check(serial, assigned);
+      }
+    }
+  }
+}
+
+template<typename F>
+void parallel_assign(const char *name) {
+  with_faults<F>(name, [](unsigned seed, fault faults) {
+    parallel_assign<F>(seed, faults);
+  });
+}
+
+// Sets values through set_value with rvalues and through emplace_value, which must
+// not copy the arguments or the values, whether the point is new, overwritten or
+// already has an equivalent value. A call that fails, also while constructing the
+// argument or the value, must leave the function unchanged.
+template<typename F>
+void random_moves(unsigned seed, fault faults) {
+  std::mt19937 rng(seed);
+  F f;
+  model m;
+  for (int i = 0; i < 1500; i++) {
+    int a = rng() % 30;
+    int v = rng() % 5;
+    int op = rng() % 4;
+    if (rng() % 10 == 0) {
+      unarmed guard;
+      f.erase(Tracked(a));
+      m.erase(a);
+    }
+    copies = 0;
+    arm(faults, rng);
+    try {
+      if (op == 0) {
+        f.set_value(Tracked(a), Tracked(v));
+      } else if (op == 1) {
+        f.emplace_value(a, v);
+      } else if (op == 2) {
+        f.emplace_value(Tracked(a), v);
+      } else {
+        f.emplace_value(a, Tracked(v));
+      }
+      disarm();
+      m[a] = v;
+    } catch (injected_fault &) {
+      CHECK(faults == fault::operations);
+    } catch (std::bad_alloc &) {
+      CHECK(faults == fault::allocations);
+    }
+    disarm();
+    CHECK(copies == 0);
+    check(f, m);
+  }
+}
+
+template<typename F>
+void random_moves(const char *name) {
+  for (unsigned seed = 1; seed <= 4; seed++) {
+    for (fault faults : {fault::none, fault::operations, fault::allocations}) {
+      run(name, seed, [&](unsigned s) { random_moves<F>(s, faults); });
+    }
+  }
+}
+
+// Replays the changes of the maxima reported to the sink of a function, which runs
+// random operations and transactions, and checks that the replayed set is the set
+// of maxima after every operation, whether it succeeds or fails.
+template<typename F>
+void random_feed(unsigned seed, int range, fault faults) {
+  using A = arg_of<F>;
+  using V = value_of<F>;
+  constexpr bool batches = function_maxima_detail::has_stable_iterators<typename F::point_set>::value;
+  std::mt19937 rng(seed);
+  F f;
+  std::set<std::pair<int, int>> replayed;
+  f.subscribe([&](maxima_change change, const typename F::point_type &p) {
+    unarmed guard;
+    std::pair<int, int> point(to_int(p.arg()), to_int(p.value()));
+    if (change == maxima_change::added) {
+      CHECK(replayed.insert(point).second);
+    } else {
+      CHECK(replayed.erase(point) == 1);
+    }
+  });
+  auto check_feed = [&] {
+    unarmed guard;
+    std::set<std::pair<int, int>> maxima;
+    for (auto it = f.mx_begin(); it != f.mx_end(); ++it) {
+      maxima.emplace(to_int(it->arg()), to_int(it->value()));
+    }
+    CHECK(replayed == maxima);
+  };
+
+  for (int i = 0; i < 1000; i++) {
+    if (!f.in_transaction() && rng() % 20 == 0) {
+      f.begin_transaction();
+    }
+    int op = rng() % 10;
+    int a = rng() % range;
+    int b = a + static_cast<int>(rng() % 8) - 1;
+    pairs_of<F> pairs;
+    model ignored;
+    if (op == 7) {
+      for (int j = rng() % 8; j > 0; j--) {
+        pairs.emplace_back(make<A>(rng() % range), make<V>(rng() % 5));
+      }
+    } else if (op == 8) {
+      pairs = random_pairs<F>(rng, rng() % 12, range, ignored);
+    }
+    V value = make<V>(rng() % 5);
+
+    arm(faults, rng);
+    try {
+      if (op < 4) {
+        f.set_value(make<A>(a), value);
+      } else if (op < 6) {
+        f.erase(make<A>(a));
+      } else if (op < 7) {
+        f.erase_range(make<A>(a), make<A>(b));
+      } else if (op < 8) {
+        if constexpr (batches) {
+          f.set_values(pairs.begin(), pairs.end());
+        } else {
+          f.set_value(make<A>(a), value);
+        }
+      } else if (op < 9) {
+        f.assign(pairs.begin(), pairs.end());
+      } else if (f.in_transaction()) {
+        f.rollback();
+      }
+    } catch (injected_fault &) {
+      CHECK(faults == fault::operations);
+    } catch (std::bad_alloc &) {
+      CHECK(faults == fault::allocations);
+    }
+    disarm();
+    check_feed();
+    if (f.in_transaction() && rng() % 15 == 0) {
+      f.commit();
+    }
+  }
+}
+
+template<typename F>
+void random_feed(const char *name, int range) {
+  with_faults<F>(name, [=](unsigned seed, fault faults) {
+    random_feed<F>(seed, range, faults);
+  });
+}
+
+// Sets random values with set_value_hint, given the position it returned last time,
+// the exact position, the position that follows, begin() or end(), and checks that
+// it returns the position of the point. Arguments greater than all the others are
+// appended now and then. Where iterators are stable, every position returned
+// earlier must still be the one of its point.
+template<typename F>
+void random_hints(unsigned seed, int range, fault faults) {
+  using A = arg_of<F>;
+  using V = value_of<F>;
+  constexpr bool stable = function_maxima_detail::has_stable_iterators<typename F::point_set>::value;
+  std::mt19937 rng(seed);
+  F f;
+  model m;
+  std::map<int, typename F::iterator> returned;
+  typename F::iterator last = f.end();
+  for (int i = 0; i < 2000; i++) {
+    if (i % 300 == 0) {
+      f = F();
+      m.clear();
+      returned.clear();
+      last = f.end();
+    }
+    int a = rng() % 8 == 0 && !m.empty() ? std::prev(m.end())->first + 1 + static_cast<int>(rng() % 2)
+                                         : static_cast<int>(rng() % range);
+    int v = rng() % 5;
+    typename F::iterator hint;
+    switch (rng() % 5) {
+    case 0:
+      hint = last;
+      break;
+    case 1:
+      hint = f.find(make<A>(a));
+      break;
+    case 2: {
+      auto following = m.upper_bound(a);
+      hint = following == m.end() ? f.end() : f.find(make<A>(following->first));
+      break;
+    }
+    case 3:
+      hint = f.begin();
+      break;
+    default:
+      hint = f.end();
+      break;
+    }
+    A key = make<A>(a);
+    V value = make<V>(v);
+
+    arm(faults, rng);
+    try {
+      typename F::iterator it = f.set_value_hint(hint, key, value);
+      disarm();
+      m[a] = v;
+      CHECK(it == f.find(key) && same(*it, std::make_pair(a, v)));
+      auto following = m.upper_bound(a);
+      CHECK(std::next(it) == (following == m.end() ? f.end() : f.find(make<A>(following->first))));
+      last = it;
+      returned[a] = it;
+    } catch (injected_fault &) {
+      CHECK(faults == fault::operations);
+    } catch (std::bad_alloc &) {
+      CHECK(faults == fault::allocations);
+    }
+    disarm();
+    check(f, m);
+    if constexpr (stable) {
+      for (const auto &p : returned) {
+        CHECK(p.second == f.find(make<A>(p.first)) && same(*p.second, *m.find(p.first)));
+      }
+    } else {
+      last = f.end();
+    }
+  }
+}
+
+template<typename F>
+void random_hints(const char *name, int range) {
+  with_faults<F>(name, [=](unsigned seed, fault faults) {
+    random_hints<F>(seed, range, faults);
+  });
+}
+
+// Runs random operations within transactions, which are committed or rolled back
+// at random. Rolling back may fail with an injected fault too, and is repeated
+// until it succeeds. Assigning to the function and swapping it are logged.
+template<typename F>
+void random_transactions(unsigned seed, int range, fault faults) {
+  using A = arg_of<F>;
+  using V = value_of<F>;
+  std::mt19937 rng(seed);
+  F f;
+  model m;
+  model saved;
+  for (int i = 0; i < 800; i++) {
+    if (!f.in_transaction() && rng() % 20 == 0) {
+      f.begin_transaction();
+      saved = m;
+    }
+    int op = rng() % 12;
+    int a = rng() % range;
+    int b = a + static_cast<int>(rng() % 8) - 1;
+    int v = rng() % 5;
+    model expected = m;
+    pairs_of<F> pairs;
+    F other;
+    if (op < 5) {
+      expected[a] = v;
+    } else if (op < 7) {
+      expected.erase(a);
+    } else if (op < 8) {
+      expected.erase(expected.lower_bound(a), expected.lower_bound(std::max(a, b)));
+    } else if (op < 10) {
+      // A batch of a single pair if set_values is not available.
+      int size = function_maxima_detail::has_stable_iterators<typename F::point_set>::value ? rng() % 8 : 1;
+      for (int j = 0; j < size; j++) {
+        int x = rng() % range;
+        int y = rng() % 5;
+        pairs.emplace_back(make<A>(x), make<V>(y));
+        expected[x] = y;
+      }
+    } else if (op < 11) {
+      expected.clear();
+      pairs = random_pairs<F>(rng, rng() % 12, range, expected);
+    } else {
+      expected.clear();
+      for (int j = rng() % 8; j > 0; j--) {
+        int x = rng() % range;
+        int y = rng() % 5;
+        other.set_value(make<A>(x), make<V>(y));
+        expected[x] = y;
+      }
+    }
+
+    arm(faults, rng);
+    try {
+      if (op < 5) {
+        f.set_value(make<A>(a), make<V>(v));
+      } else if (op < 7) {
+        f.erase(make<A>(a));
+      } else if (op < 8) {
+        f.erase_range(make<A>(a), make<A>(b));
+      } else if (op < 10) {
+        if constexpr (function_maxima_detail::has_stable_iterators<typename F::point_set>::value) {
+          f.set_values(pairs.begin(), pairs.end());
+        } else {
+          f.set_value(pairs[0].first, pairs[0].second);
+        }
+      } else if (op < 11) {
+        f.assign(pairs.begin(), pairs.end());
+      } else if (rng() % 2 == 0) {
+        f = other;
+      } else {
+        // The transaction goes with the points: other takes it and is rolled back
+        // to the points saved when it began, then the functions are swapped back.
+        disarm();
+        bool open = f.in_transaction();
+        f.swap(other);
+        CHECK(!f.in_transaction() && other.in_transaction() == open);
+        check(f, expected);
+        check(other, m);
+        if (open) {
+          other.rollback();
+          check(other, saved);
+          f.swap(other);
+          expected = saved;
+        }
+      }
+      disarm();
+      m = std::move(expected);
+    } catch (injected_fault &) {
+      CHECK(faults == fault::operations);
+    } catch (std::bad_alloc &) {
+      CHECK(faults == fault::allocations);
+    }
+    disarm();
+    check(f, m);
+
+    if (f.in_transaction() && rng() % 15 == 0) {
+      if (rng() % 2 == 0) {
+        f.commit();
+      } else {
+        for (int tries = 0; f.in_transaction(); tries++) {
+          arm(faults, rng, 10 + tries);
+          try {
+            f.rollback();
+          } catch (injected_fault &) {
+            CHECK(faults == fault::operations);
+          } catch (std::bad_alloc &) {
+            CHECK(faults == fault::allocations);
+          }
+          disarm();
+        }
+        m = saved;
+      }
+      CHECK(!f.in_transaction());
+      check(f, m);
+    }
+  }
+}
+
+template<typename F>
+void random_transactions(const char *name, int range) {
+  with_faults<F>(name, [=](unsigned seed, fault faults) {
+    random_transactions<F>(seed, range, faults);
+  });
+}
+
+// Applies random operations to a function split into shards at arguments that are
+// set as well, so that the maxima on both sides of every boundary are merged.
+template<typename A, typename V>
+void random_shards(unsigned seed, int operations, fault faults) {
+  std::mt19937 rng(seed);
+  ConcurrentFunctionMaxima<A, V> f({make<A>(10), make<A>(20), make<A>(21), make<A>(35)});
+  model m;
+  for (int i = 0; i < operations; i++) {
+    bool filling = i / 300 % 2 == 0;
+    int a = rng() % 45;
+    int v = rng() % 5;
+    bool setting = static_cast<int>(rng() % 10) < (filling ? 8 : 3);
+    A key = make<A>(a);
+    V value = make<V>(v);
+    arm(faults, rng);
+    try {
+      if (setting) {
+        f.set_value(key, value);
+      } else {
+        f.erase(key);
+      }
+      disarm();
+      if (setting) {
+        m[a] = v;
+      } else {
+        m.erase(a);
+      }
+    } catch (injected_fault &) {
+      CHECK(faults == fault::operations);
+    } catch (std::bad_alloc &) {
+      CHECK(faults == fault::allocations);
+    }
+    disarm();
+    CHECK(f.size() == m.size());
+    for (const auto &p : m) {
+      CHECK(to_int(f.value_at(make<A>(p.first))) == p.second);
+    }
+    auto view = f.maxima();
+    check_sequence(view.begin(), view.end(), maxima_of(m));
+  }
+}
+
+// Writers set and erase disjoint arguments while a reader checks that every view of
+// the maxima is ordered, then the function is compared with the writers' models.
+void concurrent_shards(unsigned seed) {
+  constexpr int writers = 4;
+  constexpr int range = 400;
+  ConcurrentFunctionMaxima<int, int> f({100, 200, 300});
+  std::vector<model> models(writers);
+  std::atomic<int> running(writers);
+  std::atomic<bool> ordered(true);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < writers; t++) {
+    threads.emplace_back([&, t] {
+      std::mt19937 rng(seed * writers + t);
+      for (int i = 0; i < 20000; i++) {
+        int a = static_cast<int>(rng() % (range / writers)) * writers + t;
+        int v = rng() % 5;
+        if (rng() % 3 != 0) {
+          f.set_value(a, v);
+          models[t][a] = v;
+        } else {
+          f.erase(a);
+          models[t].erase(a);
+        }
+      }
+      --running;
+    });
+  }
+  threads.emplace_back([&] {
+    while (running > 0) {
+      auto view = f.maxima();
+      auto it = view.begin();
+      if (it == view.end()) {
+        continue;
+      }
+      for (auto previous = it++; it != view.end(); previous = it++) {
+        if (previous->value() != it->value() ? previous->value() < it->value()
+                                             : !(previous->arg() < it->arg())) {
+          ordered = false;
+        }
+      }
+    }
+  });
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  CHECK(ordered);
+  model m;
+  for (const model &part : models) {
+    m.insert(part.begin(), part.end());
+  }
+  CHECK(f.size() == m.size());
+  auto view = f.maxima();
+  check_sequence(view.begin(), view.end(), maxima_of(m));
+}
+
+// Version k of a published function, whose values tell k.
+model version(int k) {
+  model m;
+  for (int a = 0; a <= k % 30; a++) {
+    m[a] = 5 * k + (a * 7 + k) % 5;
+  }
+  return m;
+}
+
+// Turns the draft into version k, by assigning it or by setting and erasing points.
+template<typename A, typename V>
+void write_version(PublishedFunctionMaxima<A, V> &f, int k, const model &previous) {
+  model m = version(k);
+  if (k % 2 == 0) {
+    std::vector<std::pair<A, V>> pairs;
+    for (const auto &p : m) {
+      pairs.emplace_back(make<A>(p.first), make<V>(p.second));
+    }
+    f.assign(pairs.begin(), pairs.end());
+    return;
+  }
+  for (const auto &p : previous) {
+    if (m.count(p.first) == 0) {
+      f.erase(make<A>(p.first));
+    }
+  }
+  for (const auto &p : m) {
+    f.set_value(make<A>(p.first), make<V>(p.second));
+  }
+}
+
+// Publishes versions under injected faults. A version that fails to be written or
+// published must leave the readers with the previous one, and a version pinned by a
+// reader must not change while later ones are published.
+template<typename A, typename V>
+void random_publishing(unsigned seed, fault faults) {
+  std::mt19937 rng(seed);
+  PublishedFunctionMaxima<A, V> f;
+  typename PublishedFunctionMaxima<A, V>::reader latest(f), old(f);
+  model draft, published;
+  const auto *kept = &old.pin();
+  model pinned;
+  for (int k = 1; k <= 300; k++) {
+    arm(faults, rng, 20);
+    try {
+      write_version(f, k, draft);
+      disarm();
+      draft = version(k);
+      arm(faults, rng, 4);
+      f.publish();
+      disarm();
+      published = draft;
+    } catch (injected_fault &) {
+      CHECK(faults == fault::operations);
+    } catch (std::bad_alloc &) {
+      CHECK(faults == fault::allocations);
+    }
+    disarm();
+    // A write that failed halfway leaves a mix of versions k - 1 and k, and the
+    // draft is restored.
+    if (k % 2 == 1 && draft != version(k)) {
+      unarmed guard;
+      std::vector<std::pair<A, V>> pairs;
+      for (const auto &p : draft) {
+        pairs.emplace_back(make<A>(p.first), make<V>(p.second));
+      }
+      f.assign(pairs.begin(), pairs.end());
+    }
+    check(f.unpublished(), draft);
+    check(latest.pin(), published);
+    check(*kept, pinned);
+    if (k % 50 == 0) {
+      kept = &old.pin();
+      pinned = published;
+    }
+  }
+  latest.unpin();
+}
+
+// Readers pin the latest version over and over while the writer publishes new
+// ones, and check that every version they see is one of those published.
+void concurrent_publishing(unsigned seed) {
+  PublishedFunctionMaxima<int, int> f;
+  std::atomic<bool> done(false);
+  std::atomic<bool> consistent(true);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 3; t++) {
+    readers.emplace_back([&] {
+      PublishedFunctionMaxima<int, int>::reader reader(f);
+      int last = 0;
+      while (!done) {
+        const auto &g = reader.pin();
+        int k = g.size() == 0 ? 0 : g.begin()->value() / 5;
+        try {
+          CHECK(k >= last);
+          check(g, k == 0 ? model() : version(k));
+        } catch (test_failure &) {
+          consistent = false;
+        }
+        last = k;
+        if (k % 3 == 0) {
+          reader.unpin();
+        }
+      }
+    });
+  }
+  model draft;
+  for (int k = 1; k <= 3000; k++) {
+    write_version(f, k, draft);
+    draft = version(k);
+    if ((k + seed) % 4 != 0) {
+      f.publish();
+    }
+  }
+  done = true;
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  CHECK(consistent);
+}
+
+// Values of few kinds, so that neighbours are often equal, and NaNs for floating
+// point types.
+template<typename V>
+std::vector<V> random_values(std::mt19937 &rng, std::size_t n) {
+  std::vector<V> result(n);
+  for (V &v : result) {
+    v = static_cast<V>(static_cast<int>(rng() % 5) - 2);
+    if (std::is_floating_point<V>::value && rng() % 8 == 0) {
+      v = std::numeric_limits<V>::quiet_NaN();
+    }
+  }
+  return result;
+}
+
+template<bool Minimum, typename V>
+void check_mask(const std::vector<V> &values, const std::vector<std::uint64_t> &mask) {
+  std::size_t n = values.size();
+  for (std::size_t i = 0; i < n; i++) {
+    const V *left = i == 0 ? nullptr : &values[i - 1];
+    const V *right = i + 1 == n ? nullptr : &values[i + 1];
+    bool expected = Minimum ? function_maxima_detail::is_local_minimum(left, values[i], right)
+                            : function_maxima_detail::is_local_maximum(left, values[i], right);
+    CHECK((mask[i / 64] >> (i % 64) & 1) == expected);
+  }
+  // Bits past the values must be left cleared.
+  for (std::size_t i = n; i < mask.size() * 64; i++) {
+    CHECK((mask[i / 64] >> (i % 64) & 1) == 0);
+  }
+}
+
+// Compares the masks of local extrema, computed with vector instructions where the
+// processor has them, with is_local_maximum and is_local_minimum.
+template<typename V, bool Minimum>
+void random_masks(unsigned seed) {
+  std::mt19937 rng(seed);
+  for (std::size_t n = 0; n <= 300; n++) {
+    for (int round = 0; round < 4; round++) {
+      std::vector<V> values = random_values<V>(rng, n);
+      std::vector<std::uint64_t> mask(n / 64 + 1);
+      function_maxima_detail::extrema_mask<Minimum>(values.data(), n, mask.data());
+      check_mask<Minimum>(values, mask);
+#if defined(__GNUC__) && defined(__x86_64__)
+      if constexpr (function_maxima_detail::has_extrema_kernel<V>) {
+        if (function_maxima_detail::has_avx2()) {
+          std::fill(mask.begin(), mask.end(), 0);
+          function_maxima_detail::extrema_mask_avx2<Minimum>(values.data(), n, mask.data());
+          check_mask<Minimum>(values, mask);
+        }
+      }
+#endif
+    }
+  }
+}
+
+template<typename V>
+void random_masks(const char *name) {
+  for (unsigned seed = 1; seed <= 2; seed++) {
+    run(name, seed, random_masks<V, false>);
+    run(name, seed, random_masks<V, true>);
+  }
+}
+
+} // namespace
+
+int main() {
+  random_operations<FunctionMaxima<int, int>>("FunctionMaxima<int, int>", 2000, 40);
+  random_operations<FunctionMaxima<Number, Number>>("FunctionMaxima<Number, Number>", 2000, 30);
+  random_operations<FunctionMaxima<int, std::string, single_threaded_t>>(
+      "FunctionMaxima<int, std::string, single_threaded_t>", 1000, 60);
+  random_operations<FunctionMaxima<Number, Number, track_minima_t<maxima_by_argument_t<>>>>(
+      "FunctionMaxima with track_minima_t and maxima_by_argument_t", 1000, 30);
+  random_operations<FunctionMaxima<Number, Number, counted_t<>>>("FunctionMaxima with an allocator", 1000, 30);
+
+  // Wide ranges give trees of several levels, whose leaves and inner nodes are
+  // split, borrow from their siblings and are merged with them.
+  random_operations<FunctionMaxima<int, int, btree_t<>>>("btree_t<int, int>", 6000, 3000);
+  random_operations<FunctionMaxima<Number, Number, btree_t<>>>("btree_t<Number, Number>", 3000, 600);
+  random_operations<FunctionMaxima<int, std::string, counted_t<btree_t<>>>>(
+      "btree_t<int, std::string> with an allocator", 3000, 1000);
+  random_operations<FunctionMaxima<Number, Number, track_minima_t<maxima_by_argument_t<btree_t<>>>>>(
+      "btree_t with track_minima_t and maxima_by_argument_t", 1000, 40);
+
+  // The treap of range_max_t stages its changes, which are rolled back when the
+  // operation fails.
+  random_operations<FunctionMaxima<int, int, range_max_t<>>>("range_max_t<int, int>", 2000, 40);
+  random_operations<FunctionMaxima<Number, Number, range_max_t<>>>("range_max_t<Number, Number>", 1000, 30);
+  random_operations<FunctionMaxima<Number, Number, track_minima_t<range_max_t<maxima_by_argument_t<btree_t<>>>>>>(
+      "btree_t with every policy", 1000, 40);
+  random_operations<FunctionMaxima<int, std::string, range_max_t<counted_t<>>>>("range_max_t with an allocator", 1000, 40);
+
+  random_operations<FlatFunctionMaxima<int, int>>("FlatFunctionMaxima<int, int>", 2000, 40);
+  random_operations<FlatFunctionMaxima<Number, Number>>("FlatFunctionMaxima<Number, Number>", 1000, 30);
+  random_operations<DenseFunctionMaxima<int, int>>("DenseFunctionMaxima<int, int>", 2000, 200);
+  random_operations<DenseFunctionMaxima<long, std::string>>("DenseFunctionMaxima<long, std::string>", 1000, 40);
+  random_operations<DenseFunctionMaxima<int, std::string, counted_t<>>>(
+      "DenseFunctionMaxima with an allocator", 1000, 40);
+  random_operations<PersistentFunctionMaxima<int, int>>("PersistentFunctionMaxima<int, int>", 2000, 40);
+  random_operations<PersistentFunctionMaxima<int, std::string, counted_t<>>>(
+      "PersistentFunctionMaxima with an allocator", 1000, 40);
+  random_operations<PersistentFunctionMaxima<Number, Number>>("PersistentFunctionMaxima<Number, Number>", 1000, 30);
+
+  random_batches<FunctionMaxima<int, int>>("set_values of FunctionMaxima<int, int>", 60);
+  random_batches<FunctionMaxima<Number, Number>>("set_values of FunctionMaxima<Number, Number>", 40);
+  random_batches<FunctionMaxima<Number, Number, track_minima_t<maxima_by_argument_t<>>>>(
+      "set_values with track_minima_t and maxima_by_argument_t", 40);
+  random_batches<FunctionMaxima<Number, Number, range_max_t<>>>("set_values with range_max_t", 40);
+  random_batches<FlatFunctionMaxima<int, std::string>>("set_values of FlatFunctionMaxima<int, std::string>", 60);
+  random_batches<FlatFunctionMaxima<Number, Number>>("set_values of FlatFunctionMaxima<Number, Number>", 40);
+
+  with_faults<PersistentFunctionMaxima<int, int>>("snapshots of PersistentFunctionMaxima<int, int>",
+                                                  random_snapshots<PersistentFunctionMaxima<int, int>>);
+  with_faults<PersistentFunctionMaxima<Number, Number>>("snapshots of PersistentFunctionMaxima<Number, Number>",
+                                                        random_snapshots<PersistentFunctionMaxima<Number, Number>>);
+
+  for (unsigned seed = 1; seed <= 2; seed++) {
+    run("iterators of PersistentFunctionMaxima", seed, random_walks<PersistentFunctionMaxima<int, int>>);
+  }
+
+  parallel_assign<FunctionMaxima<int, int>>("threaded assign of FunctionMaxima<int, int>");
+  parallel_assign<FunctionMaxima<Number, Number, track_minima_t<>>>("threaded assign with track_minima_t");
+  parallel_assign<FlatFunctionMaxima<int, std::string>>("threaded assign of FlatFunctionMaxima");
+  parallel_assign<PersistentFunctionMaxima<int, int>>("threaded assign of PersistentFunctionMaxima");
+
+  random_moves<FunctionMaxima<Tracked, Tracked>>("set_value and emplace_value of FunctionMaxima");
+  random_moves<FunctionMaxima<Tracked, Tracked, btree_t<>>>("set_value and emplace_value with btree_t");
+  random_moves<FunctionMaxima<Tracked, Tracked, track_minima_t<maxima_by_argument_t<>>>>(
+      "set_value and emplace_value with track_minima_t and maxima_by_argument_t");
+
+  random_feed<FunctionMaxima<int, int>>("change feed of FunctionMaxima<int, int>", 40);
+  random_feed<FunctionMaxima<Number, Number>>("change feed of FunctionMaxima<Number, Number>", 30);
+  random_feed<FunctionMaxima<Number, Number, btree_t<>>>("change feed with btree_t", 60);
+  random_feed<FunctionMaxima<Number, Number, track_minima_t<range_max_t<maxima_by_argument_t<>>>>>(
+      "change feed with every policy", 30);
+
+  random_hints<FunctionMaxima<int, int>>("set_value_hint of FunctionMaxima<int, int>", 40);
+  random_hints<FunctionMaxima<Number, Number>>("set_value_hint of FunctionMaxima<Number, Number>", 30);
+  random_hints<FunctionMaxima<int, std::string>>("set_value_hint of FunctionMaxima<int, std::string>", 40);
+  random_hints<FunctionMaxima<Number, Number, btree_t<>>>("set_value_hint with btree_t", 300);
+
+  random_transactions<FunctionMaxima<int, int>>("transactions of FunctionMaxima<int, int>", 40);
+  random_transactions<FunctionMaxima<Number, Number>>("transactions of FunctionMaxima<Number, Number>", 30);
+  random_transactions<FunctionMaxima<Number, Number, btree_t<>>>("transactions with btree_t", 30);
+  random_transactions<FunctionMaxima<Number, Number, track_minima_t<range_max_t<maxima_by_argument_t<>>>>>(
+      "transactions with every policy", 30);
+  random_transactions<FunctionMaxima<int, std::string, counted_t<btree_t<>>>>(
+      "transactions with an allocator and btree_t", 40);
+
+  // Shards are compared with their neighbours only when the maxima are read.
+  with_faults<FunctionMaxima<int, int>>("ConcurrentFunctionMaxima<int, int>", [](unsigned seed, fault faults) {
+    random_shards<int, int>(seed, 1500, faults);
+  });
+  with_faults<FunctionMaxima<Number, Number>>("ConcurrentFunctionMaxima<Number, Number>", [](unsigned seed, fault faults) {
+    random_shards<Number, Number>(seed, 1000, faults);
+  });
+  for (unsigned seed = 1; seed <= 2; seed++) {
+    run("ConcurrentFunctionMaxima with threads", seed, concurrent_shards);
+  }
+
+  // Published versions share their nodes with the draft and with each other.
+  with_faults<PersistentFunctionMaxima<int, int>>("PublishedFunctionMaxima<int, int>", [](unsigned seed, fault faults) {
+    random_publishing<int, int>(seed, faults);
+  });
+  with_faults<PersistentFunctionMaxima<Number, Number>>("PublishedFunctionMaxima<Number, Number>", [](unsigned seed, fault faults) {
+    random_publishing<Number, Number>(seed, faults);
+  });
+  for (unsigned seed = 1; seed <= 2; seed++) {
+    run("PublishedFunctionMaxima with threads", seed, concurrent_publishing);
+  }
+
+  random_masks<int>("extrema_mask of int");
+  random_masks<long>("extrema_mask of long");
+  random_masks<float>("extrema_mask of float");
+  random_masks<double>("extrema_mask of double");
+  random_operations<FunctionMaxima<int, double>>("FunctionMaxima<int, double>", 1000, 40);
+  random_operations<FlatFunctionMaxima<int, long>>("FlatFunctionMaxima<int, long>", 1000, 40);
+
+  if (failures > 0) {
+    std::printf("%d tests failed\n", failures);
+    return 1;
+  }
+  std::printf("all tests passed\n");
+  return 0;
+}